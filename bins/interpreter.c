@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "src/chunk.h"
 #include "src/common.h"
+#include "src/compiler.h"
 #include "src/debug.h"
+#include "src/pactb.h"
 #include "src/vm.h"
 
 static void repl() {
@@ -44,9 +47,72 @@ static char *readFile(const char *path) {
   return buf;
 }
 
+// Compiled scripts are cached as .pactb files and reused while the source is
+// unchanged. The cache goes in a __pactcache__ directory beside the script,
+// so it never replaces (or runs) a file pactc wrote there, or in
+// PACT_CACHE_DIR when that is set; setting it to the empty string turns
+// caching off.
+#define CACHE_DIR "__pactcache__"
+
+static char *cachePath(const char *path, uint64_t hash) {
+  const char *dir = getenv("PACT_CACHE_DIR");
+  if (!dir) {
+    const char *slash = strrchr(path, '/');
+    size_t dirLength = slash ? (size_t)(slash + 1 - path) : 0;
+    char *script = malloc(strlen(path) + sizeof(CACHE_DIR "/"));
+    if (!script) {
+      fprintf(stderr, "Couldn't allocate enough memory for the cache path.\n");
+      exit(74);
+    }
+    memcpy(script, path, dirLength);
+    strcpy(script + dirLength, CACHE_DIR);
+    // It may already exist, and if it can't be made writing the cache fails
+    mkdir(script, 0777);
+    sprintf(script + dirLength + strlen(CACHE_DIR), "/%s", path + dirLength);
+    char *cache = pactbPath(script);
+    free(script);
+    return cache;
+  }
+  if (!*dir) {
+    return NULL;
+  }
+  char *cache = malloc(strlen(dir) + 32);
+  if (!cache) {
+    fprintf(stderr, "Couldn't allocate enough memory for the cache path.\n");
+    exit(74);
+  }
+  sprintf(cache, "%s/%016llx.pactb", dir, (unsigned long long)hash);
+  return cache;
+}
+
+static InterpretResult interpretCached(const char *path, const char *src) {
+  uint64_t hash = hashSource(src);
+  char *cache = cachePath(path, hash);
+  if (!cache) {
+    return interpret(src);
+  }
+  ObjFunction *function = loadPactb(cache, &hash);
+  if (!function) {
+    function = compile(src);
+    if (function == NULL) {
+      free(cache);
+      return INTERPRET_COMPILE_ERROR;
+    }
+    // A cache that can't be written only costs the next run a compile
+    writePactb(cache, function, hash, true);
+  }
+  free(cache);
+  push(OBJ_VAL(function));
+  ObjClosure *closure = newClosure(function);
+  pop();
+  push(OBJ_VAL(closure));
+  callClosure(closure, 0);
+  return run();
+}
+
 static void runFile(const char *path) {
   char *src = readFile(path);
-  InterpretResult result = interpret(src);
+  InterpretResult result = interpretCached(path, src);
   free(src);
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
@@ -65,5 +131,6 @@ int main(int argc, const char **argv) {
     exit(1);
   }
   freeVM();
+  unloadPactb();
   return 0;
 }
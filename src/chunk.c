@@ -1,6 +1,8 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
+#include "varint.h"
 #include "vm.h"
 #include <stdlib.h>
 
@@ -9,6 +11,8 @@ void initChunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineInfo = NULL;
+  chunk->lineInfoSize = 0;
   initValueArray(&chunk->constants);
 }
 
@@ -32,8 +36,157 @@ int addConstant(Chunk *chunk, Value value) {
 }
 
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // Without a capacity the arrays are borrowed, from a mapped .pactb file
+  if (chunk->capacity > 0) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->lines) {
+      FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
+    FREE_ARRAY(uint8_t, chunk->lineInfo, chunk->lineInfoSize);
+  }
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
+
+// Encodes the runs of lines into out, or only measures them when out is NULL
+static int encodeLines(Chunk *chunk, uint8_t *out) {
+  uint8_t scratch[VARINT_MAX];
+  int size = 0;
+  int line = 0;
+  for (int start = 0; start < chunk->count;) {
+    int end = start + 1;
+    while (end < chunk->count && chunk->lines[end] == chunk->lines[start]) {
+      end++;
+    }
+    size += encodeVarint(end - start, out ? out + size : scratch);
+    size += encodeVarint(zigzagEncode(chunk->lines[start] - line),
+                         out ? out + size : scratch);
+    line = chunk->lines[start];
+    start = end;
+  }
+  return size;
+}
+
+void packLines(Chunk *chunk) {
+  int size = encodeLines(chunk, NULL);
+  uint8_t *lineInfo = ALLOCATE(uint8_t, size);
+  encodeLines(chunk, lineInfo);
+  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  chunk->lines = NULL;
+  chunk->lineInfo = lineInfo;
+  chunk->lineInfoSize = size;
+}
+
+int getLine(Chunk *chunk, int offset) {
+  if (chunk->lines) {
+    return chunk->lines[offset];
+  }
+  const uint8_t *info = chunk->lineInfo;
+  const uint8_t *end = info + chunk->lineInfoSize;
+  uint64_t start = 0;
+  int64_t line = 0;
+  while (info < end) {
+    uint64_t length, delta;
+    int read = decodeVarint(info, end, &length);
+    if (!read) {
+      break;
+    }
+    info += read;
+    read = decodeVarint(info, end, &delta);
+    if (!read) {
+      break;
+    }
+    info += read;
+    start += length;
+    line += zigzagDecode(delta);
+    if ((uint64_t)offset < start) {
+      return (int)line;
+    }
+  }
+  return 0;
+}
+
+// Size in bytes of the instruction at offset, including its operands
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+  case OP_GET_LOCAL_INDEX:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_BUILD_LIST:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+  case OP_INCREMENT_LOCAL:
+  case OP_EQUAL_JUMP:
+  case OP_NOT_EQUAL_JUMP:
+  case OP_GREATER_JUMP:
+  case OP_GREATER_EQUAL_JUMP:
+  case OP_LESS_JUMP:
+  case OP_LESS_EQUAL_JUMP:
+  case OP_GREATER_JUMP_INT:
+  case OP_GREATER_JUMP_FLOAT:
+  case OP_LESS_JUMP_INT:
+  case OP_LESS_JUMP_FLOAT:
+  case OP_GREATER_JUMP_GENERIC:
+  case OP_LESS_JUMP_GENERIC:
+  case OP_ADD_LL:
+  case OP_ADD_LK:
+  case OP_SUBTRACT_LL:
+  case OP_SUBTRACT_LK:
+  case OP_MOVE:
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_SET_UPVALUE_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+    return 3;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_ADD_LLL:
+  case OP_ADD_LLK:
+  case OP_SUBTRACT_LLL:
+  case OP_SUBTRACT_LLK:
+    return 4;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_LESS_JUMP_LL:
+  case OP_LESS_JUMP_LK:
+  case OP_GREATER_JUMP_LL:
+  case OP_GREATER_JUMP_LK:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+    return 5;
+  case OP_CLOSURE: {
+    uint8_t constant = chunk->code[offset + 1];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return 2 + function->upvalueCount * 2;
+  }
+  case OP_CLOSURE_LONG: {
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return 3 + function->upvalueCount * 3;
+  }
+  default:
+    return 1;
+  }
+}
@@ -4,59 +4,131 @@
 #include "common.h"
 #include "value.h"
 
+#define OPCODE_LIST(X)                                                         \
+  X(OP_RETURN)                                                                 \
+  X(OP_JUMP_IF_FALSE)                                                          \
+  X(OP_JUMP)                                                                   \
+  X(OP_LOOP)                                                                   \
+  X(OP_CALL)                                                                   \
+  X(OP_INVOKE)                                                                 \
+  X(OP_SUPER_INVOKE)                                                           \
+  X(OP_CLOSURE)                                                                \
+  X(OP_CLOSE_UPVALUE)                                                          \
+  X(OP_PRINT)                                                                  \
+  X(OP_NOT)                                                                    \
+  X(OP_NEGATE)                                                                 \
+  X(OP_ADD)                                                                    \
+  X(OP_SUBTRACT)                                                               \
+  X(OP_MULTIPLY)                                                               \
+  X(OP_DIVIDE)                                                                 \
+  X(OP_CONSTANT)                                                               \
+  X(OP_NIL)                                                                    \
+  X(OP_TRUE)                                                                   \
+  X(OP_FALSE)                                                                  \
+  X(OP_POP)                                                                    \
+  X(OP_GET_LOCAL)                                                              \
+  X(OP_SET_LOCAL)                                                              \
+  X(OP_GET_UPVALUE)                                                            \
+  X(OP_SET_UPVALUE)                                                            \
+  X(OP_GET_GLOBAL)                                                             \
+  X(OP_SET_GLOBAL)                                                             \
+  X(OP_DEFINE_GLOBAL)                                                          \
+  X(OP_SET_PROPERTY)                                                           \
+  X(OP_GET_PROPERTY)                                                           \
+  X(OP_GET_SUPER)                                                              \
+  X(OP_EQUAL)                                                                  \
+  X(OP_GREATER)                                                                \
+  X(OP_LESS)                                                                   \
+  X(OP_CLASS)                                                                  \
+  X(OP_INHERIT)                                                                \
+  X(OP_METHOD)                                                                 \
+  X(OP_BUILD_LIST)                                                             \
+  X(OP_INDEX_SUBSCR)                                                           \
+  X(OP_STORE_SUBSCR)                                                           \
+  X(OP_BIT_XOR)                                                                \
+  X(OP_BIT_OR)                                                                 \
+  X(OP_BIT_AND)                                                                \
+  X(OP_LSL)                                                                    \
+  X(OP_LSR)                                                                    \
+  X(OP_NOT_EQUAL)                                                              \
+  X(OP_GREATER_EQUAL)                                                          \
+  X(OP_LESS_EQUAL)                                                             \
+  X(OP_SET_LOCAL_POP)                                                          \
+  X(OP_INCREMENT_LOCAL)                                                        \
+  X(OP_EQUAL_JUMP)                                                             \
+  X(OP_NOT_EQUAL_JUMP)                                                         \
+  X(OP_GREATER_JUMP)                                                           \
+  X(OP_GREATER_EQUAL_JUMP)                                                     \
+  X(OP_LESS_JUMP)                                                              \
+  X(OP_LESS_EQUAL_JUMP)                                                        \
+  X(OP_GET_LOCAL_PROPERTY)                                                     \
+  X(OP_GET_LOCAL_INDEX)                                                        \
+  X(OP_ADD_INT)                                                                \
+  X(OP_ADD_FLOAT)                                                              \
+  X(OP_SUBTRACT_INT)                                                           \
+  X(OP_SUBTRACT_FLOAT)                                                         \
+  X(OP_MULTIPLY_INT)                                                           \
+  X(OP_MULTIPLY_FLOAT)                                                         \
+  X(OP_GREATER_INT)                                                            \
+  X(OP_GREATER_FLOAT)                                                          \
+  X(OP_LESS_INT)                                                               \
+  X(OP_LESS_FLOAT)                                                             \
+  X(OP_GREATER_JUMP_INT)                                                       \
+  X(OP_GREATER_JUMP_FLOAT)                                                     \
+  X(OP_LESS_JUMP_INT)                                                          \
+  X(OP_LESS_JUMP_FLOAT)                                                        \
+  X(OP_ADD_LL)                                                                 \
+  X(OP_ADD_LK)                                                                 \
+  X(OP_ADD_LLL)                                                                \
+  X(OP_ADD_LLK)                                                                \
+  X(OP_SUBTRACT_LL)                                                            \
+  X(OP_SUBTRACT_LK)                                                            \
+  X(OP_SUBTRACT_LLL)                                                           \
+  X(OP_SUBTRACT_LLK)                                                           \
+  X(OP_LESS_JUMP_LL)                                                           \
+  X(OP_LESS_JUMP_LK)                                                           \
+  X(OP_GREATER_JUMP_LL)                                                        \
+  X(OP_GREATER_JUMP_LK)                                                        \
+  X(OP_MOVE)                                                                   \
+  X(OP_TAIL_CALL)                                                              \
+  X(OP_CONSTANT_LONG)                                                          \
+  X(OP_GET_LOCAL_LONG)                                                         \
+  X(OP_SET_LOCAL_LONG)                                                         \
+  X(OP_GET_UPVALUE_LONG)                                                       \
+  X(OP_SET_UPVALUE_LONG)                                                       \
+  X(OP_GET_PROPERTY_LONG)                                                      \
+  X(OP_SET_PROPERTY_LONG)                                                      \
+  X(OP_GET_SUPER_LONG)                                                         \
+  X(OP_CLOSURE_LONG)                                                           \
+  X(OP_CLASS_LONG)                                                             \
+  X(OP_METHOD_LONG)                                                            \
+  X(OP_ADD_GENERIC)                                                            \
+  X(OP_SUBTRACT_GENERIC)                                                       \
+  X(OP_MULTIPLY_GENERIC)                                                       \
+  X(OP_GREATER_GENERIC)                                                        \
+  X(OP_LESS_GENERIC)                                                           \
+  X(OP_GREATER_JUMP_GENERIC)                                                   \
+  X(OP_LESS_JUMP_GENERIC)                                                      \
+  X(OP_TAIL_INVOKE)                                                            \
+  X(OP_TAIL_SUPER_INVOKE)
+
 typedef enum {
-  OP_RETURN,
-  OP_JUMP_IF_FALSE,
-  OP_JUMP,
-  OP_LOOP,
-  OP_CALL,
-  OP_INVOKE,
-  OP_SUPER_INVOKE,
-  OP_CLOSURE,
-  OP_CLOSE_UPVALUE,
-  OP_PRINT,
-  OP_NOT,
-  OP_NEGATE,
-  OP_ADD,
-  OP_SUBTRACT,
-  OP_MULTIPLY,
-  OP_DIVIDE,
-  OP_CONSTANT,
-  OP_NIL,
-  OP_TRUE,
-  OP_FALSE,
-  OP_POP,
-  OP_GET_LOCAL,
-  OP_SET_LOCAL,
-  OP_GET_UPVALUE,
-  OP_SET_UPVALUE,
-  OP_GET_GLOBAL,
-  OP_SET_GLOBAL,
-  OP_DEFINE_GLOBAL,
-  OP_SET_PROPERTY,
-  OP_GET_PROPERTY,
-  OP_GET_SUPER,
-  OP_EQUAL,
-  OP_GREATER,
-  OP_LESS,
-  OP_CLASS,
-  OP_INHERIT,
-  OP_METHOD,
-  OP_BUILD_LIST,
-  OP_INDEX_SUBSCR,
-  OP_STORE_SUBSCR,
-  OP_BIT_XOR,
-  OP_BIT_OR,
-  OP_BIT_AND,
-  OP_LSL,
-  OP_LSR,
+#define OPCODE_ENUM(name) name,
+  OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
 } OpCode;
 
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
+  // Line of every byte while the chunk is written, NULL once it is packed
   int *lines;
+  // The packed lines: runs of bytes on the same line, each as a varint count
+  // of bytes then a zigzag varint change from the previous run's line. NULL
+  // when the chunk carries no line info.
+  uint8_t *lineInfo;
+  int lineInfoSize;
   ValueArray constants;
 } Chunk;
 
@@ -64,5 +136,10 @@ void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+// Replaces the per-byte lines of a finished chunk with the packed table
+void packLines(Chunk *chunk);
+// Line of the byte at offset, or 0 if the chunk has no line info
+int getLine(Chunk *chunk, int offset);
+int instructionLength(Chunk *chunk, int offset);
 
 #endif
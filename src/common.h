@@ -8,7 +8,23 @@
 //#define DEBUG_TRACE_EXECUTION
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//#define DEBUG_OPCODE_STATS
+
+// Dispatch run() through a table of label addresses where the compiler
+// supports it, falling back to a plain switch everywhere else.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Compile hot functions to x86-64 machine code. Native code assumes the
+// 16-byte struct value layout, and tracing needs every instruction to go
+// through run(), so either one leaves it out.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT) &&           \
+    !defined(NAN_BOXING) && !defined(DEBUG_TRACE_EXECUTION)
+#define JIT
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
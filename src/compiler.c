@@ -2,8 +2,10 @@
 #include "chunk.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,9 +28,11 @@ static void declaration();
 static void varDeclaration();
 static void parsePrecedence(Precedence p);
 static ParseRule *getRule(TokenType t);
-static uint8_t identifierConstant(Token *name);
+static uint16_t identifierConstant(Token *name);
+static uint16_t globalVariable(Token *name);
 static int resolveLocal(Compiler *compiler, Token *name);
 static int resolveUpvalue(Compiler *compiler, Token *name);
+static void addLocal(Token name);
 
 static Chunk *currentChunk() {
   return &current->function->chunk;
@@ -123,6 +127,29 @@ static void patchJump(int offset) {
   currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+static void emitShort(uint16_t value) {
+  emitBytes((value >> 8) & 0xff, value & 0xff);
+}
+
+// Emits op with a constant pool index or slot operand, switching to longOp
+// and a short operand when it does not fit in a byte
+static void emitOperand(uint8_t op, uint8_t longOp, uint16_t operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(op, (uint8_t)operand);
+  } else {
+    emitByte(longOp);
+    emitShort(operand);
+  }
+}
+
+static void emitCache() {
+  int cache = current->function->cacheCount++;
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+  emitShort(cache);
+}
+
 static void emitReturn() {
   if (current->type == TYPE_INITIALIZER) {
     emitBytes(OP_GET_LOCAL, 0);
@@ -135,6 +162,14 @@ static void emitReturn() {
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError) {
+    optimizeChunk(currentChunk());
+    function->maxStack = maxStackDepth(currentChunk(), function->arity + 1);
+  }
+  packLines(currentChunk());
+  allocateCaches(function);
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  FREE_ARRAY(ConstantSlot, current->constants, current->constantCapacity);
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -161,47 +196,194 @@ static void endScope() {
   }
 }
 
-static uint8_t makeConstant(Value value) {
+// Equal as pool entries: unlike valuesEqual, 1 and 1.0 or 0.0 and -0.0 are
+// kept apart
+static bool sameConstant(Value a, Value b) {
+  if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
+    return false;
+  }
+  if (IS_FLOATING(a)) {
+    double x = AS_FLOATING(a);
+    double y = AS_FLOATING(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+}
+
+static uint32_t hashConstant(Value value) {
+  uint64_t bits = 0;
+  switch (VALUE_TYPE(value)) {
+  case VAL_OBJ:
+    return AS_STRING(value)->hash;
+  case VAL_INTEGER:
+    bits = (uint64_t)AS_INTEGER(value);
+    break;
+  case VAL_FLOAT: {
+    double d = AS_FLOATING(value);
+    memcpy(&bits, &d, sizeof(double));
+    break;
+  }
+  case VAL_CHARACTER:
+    bits = (uint64_t)AS_CHARACTER(value);
+    break;
+  default:
+    break;
+  }
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits ^ VALUE_TYPE(value);
+}
+
+static ConstantSlot *findConstant(ConstantSlot *slots, int capacity,
+                                  Value value) {
+  uint32_t idx = hashConstant(value) & (capacity - 1);
+  for (;;) {
+    ConstantSlot *slot = &slots[idx];
+    if (slot->constant == -1 || sameConstant(slot->value, value)) {
+      return slot;
+    }
+    idx = (idx + 1) & (capacity - 1);
+  }
+}
+
+// Whether the slot still names a live pool entry for its value
+static bool constantInPool(ConstantSlot *slot) {
+  ValueArray *pool = &currentChunk()->constants;
+  return slot->constant != -1 && slot->constant < pool->count &&
+         sameConstant(pool->values[slot->constant], slot->value);
+}
+
+static void growConstants() {
+  int capacity = GROW_CAPACITY(current->constantCapacity);
+  ConstantSlot *slots = ALLOCATE(ConstantSlot, capacity);
+  for (int i = 0; i < capacity; i++) {
+    slots[i].constant = -1;
+  }
+  current->constantCount = 0;
+  for (int i = 0; i < current->constantCapacity; i++) {
+    ConstantSlot *slot = &current->constants[i];
+    if (!constantInPool(slot)) {
+      continue;
+    }
+    *findConstant(slots, capacity, slot->value) = *slot;
+    current->constantCount++;
+  }
+  FREE_ARRAY(ConstantSlot, current->constants, current->constantCapacity);
+  current->constants = slots;
+  current->constantCapacity = capacity;
+}
+
+static uint16_t makeConstant(Value value) {
+  // Functions are never equal to one another, so only strings and numbers
+  // are worth looking up
+  ConstantSlot *slot = NULL;
+  if (!IS_OBJ(value) || IS_STRING(value)) {
+    if (current->constantCount + 1 >
+        current->constantCapacity * TABLE_MAX_LOAD) {
+      push(value); // Not in the pool yet, so nothing else keeps it alive
+      growConstants();
+      pop();
+    }
+    slot = findConstant(current->constants, current->constantCapacity, value);
+    if (constantInPool(slot)) {
+      return (uint16_t)slot->constant;
+    }
+  }
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  WRITE_BARRIER(current->function, value);
+  if (constant > UINT16_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
-  return (uint8_t)constant;
+  if (slot != NULL) {
+    if (slot->constant == -1) {
+      current->constantCount++;
+    }
+    slot->value = value;
+    slot->constant = constant;
+  }
+  return (uint16_t)constant;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int start = currentChunk()->count;
+  int poolCount = currentChunk()->constants.count;
+  uint16_t constant = makeConstant(value);
+  emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, constant);
+  current->lastConstant =
+      (ConstantExpr){start, currentChunk()->count, constant, value,
+                     currentChunk()->constants.count > poolCount};
+}
+
+static void emitLiteral(Value value) {
+  int start = currentChunk()->count;
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+    return;
+  }
+  current->lastConstant =
+      (ConstantExpr){start, currentChunk()->count, -1, value, false};
+}
+
+// Returns the value of the expression compiled from start to the end of the
+// chunk if it is a single constant
+static bool constantFrom(int start, ConstantExpr *expr) {
+  *expr = current->lastConstant;
+  return expr->start == start && expr->end == currentChunk()->count;
+}
+
+// Drops the code for a constant expression, along with its pool entry when
+// the expression added it and nothing was added after it
+static void discardConstant(ConstantExpr *expr) {
+  Chunk *chunk = currentChunk();
+  chunk->count = expr->start;
+  if (expr->added && expr->constant == chunk->constants.count - 1) {
+    chunk->constants.count--;
+  }
+  current->lastConstant.start = -1;
 }
 
 static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->constants = NULL;
+  compiler->constantCount = 0;
+  compiler->constantCapacity = 0;
+  compiler->lastConstant.start = -1;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
   }
-  Local *local = &current->locals[current->localCount++];
-  local->depth = 0;
-  local->isCaptured = false;
+  Token name = {.start = "", .length = 0};
   if (type != TYPE_FUNCTION) {
-    local->name.start = "this";
-    local->name.length = 4;
-  } else {
-    local->name.start = "";
-    local->name.length = 0;
+    name.start = "this";
+    name.length = 4;
   }
+  addLocal(name);
+  current->locals[0].depth = 0;
 }
 
 static void number(bool _) {
   long v = 0;
   bool negate = false;
   bool floating = false;
+  bool tooLarge = false;
   for (const char *c = parser.previous.start; c < parser.previous.start + parser.previous.length; c++) {
     if (*c == '.') {
       floating = true;
@@ -211,10 +393,18 @@ static void number(bool _) {
       negate = true;
       continue;
     }
+    if (tooLarge || v > (INTEGER_MAX - (*c - '0')) / 10) {
+      tooLarge = true;
+      continue;
+    }
     v *= 10;
     v += *c - '0';
   }
   if (!floating) {
+    if (tooLarge) {
+      error("Integer literal out of range.");
+      return;
+    }
     if (negate) {
       v *= -1;
     }
@@ -231,25 +421,37 @@ static void string(bool _) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    getLongOp = OP_GET_UPVALUE_LONG;
+    setLongOp = OP_SET_UPVALUE_LONG;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = setLongOp = 0;
   }
 
+  uint8_t op = getOp;
+  uint8_t longOp = getLongOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    op = setOp;
+    longOp = setLongOp;
+  }
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    emitByte(op);
+    emitShort(arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitOperand(op, longOp, arg);
   }
 }
 
@@ -267,7 +469,29 @@ static void this_(bool _) {
 
 static void unary(bool _) {
   TokenType operatorType = parser.previous.type;
+  int start = currentChunk()->count;
   parsePrecedence(PREC_UNARY);
+  ConstantExpr operand;
+  if (constantFrom(start, &operand)) {
+    Value v = operand.value;
+    if (operatorType == TOKEN_BANG) {
+      discardConstant(&operand);
+      emitLiteral(BOOL_VAL(IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v))));
+      return;
+    }
+    long negated;
+    if (operatorType == TOKEN_MINUS && IS_FLOATING(v)) {
+      discardConstant(&operand);
+      emitLiteral(FLOAT_VAL(-AS_FLOATING(v)));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_INTEGER(v) &&
+        integerArithmetic('-', 0, AS_INTEGER(v), &negated)) {
+      discardConstant(&operand);
+      emitLiteral(INTEGER_VAL(negated));
+      return;
+    }
+  }
   switch (operatorType) {
   case TOKEN_BANG:
     emitByte(OP_NOT);
@@ -288,10 +512,12 @@ static void parsePrecedence(Precedence precedence) {
     return;
   }
   bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int start = currentChunk()->count;
   prefixRule(canAssign);
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    parser.operandStart = start;
     infixRule(canAssign);
   }
   if (canAssign && match(TOKEN_EQUAL)) {
@@ -299,10 +525,19 @@ static void parsePrecedence(Precedence precedence) {
   }
 }
 
-static uint8_t identifierConstant(Token *name) {
+static uint16_t identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t globalVariable(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length) {
     return false;
@@ -324,7 +559,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler *compiler, uint16_t index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
   for (int i = 0; i < upvalueCount; i++) {
     Upvalue *upvalue = &compiler->upvalues[i];
@@ -332,10 +567,16 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
       return i;
     }
   }
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount == UINT16_COUNT) {
     error("Too many closure variables in function.");
     return 0;
   }
+  if (upvalueCount == compiler->upvalueCapacity) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity,
+                                    compiler->upvalueCapacity);
+  }
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
@@ -349,7 +590,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, (uint16_t)local, true);
   }
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
@@ -359,10 +600,16 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
+  if (current->localCount == current->localCapacity) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals, oldCapacity,
+                                 current->localCapacity);
+  }
   Local *local = &current->locals[current->localCount++];
   local->name = name;
   local->depth = -1;
@@ -386,13 +633,13 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   if (current->scopeDepth > 0) {
     return 0;
   }
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -402,12 +649,13 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitByte(OP_DEFINE_GLOBAL);
+  emitShort(global);
 }
 
 static uint8_t argumentList() {
@@ -470,7 +718,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -479,27 +727,42 @@ static void function(FunctionType type) {
   block();
 
   ObjFunction *function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  uint16_t constant = makeConstant(OBJ_VAL(function));
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    wide = wide || compiler.upvalues[i].index > UINT8_MAX;
+  }
+  if (wide) {
+    emitByte(OP_CLOSURE_LONG);
+    emitShort(constant);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t)constant);
+  }
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (wide) {
+      emitShort(compiler.upvalues[i].index);
+    } else {
+      emitByte((uint8_t)compiler.upvalues[i].index);
+    }
   }
+  FREE_ARRAY(Upvalue, compiler.upvalues, compiler.upvalueCapacity);
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  uint16_t constant = identifierConstant(&parser.previous);
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
       memcmp(parser.previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitOperand(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint16_t global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -604,6 +867,24 @@ static void returnStatement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    Chunk *chunk = currentChunk();
+    int call = current->lastCall;
+    if (call >= 0 && call < chunk->count &&
+        call + instructionLength(chunk, call) == chunk->count) {
+      switch (chunk->code[call]) {
+      case OP_CALL:
+        chunk->code[call] = OP_TAIL_CALL;
+        break;
+      case OP_INVOKE:
+        chunk->code[call] = OP_TAIL_INVOKE;
+        break;
+      case OP_SUPER_INVOKE:
+        chunk->code[call] = OP_TAIL_SUPER_INVOKE;
+        break;
+      default:
+        break;
+      }
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -632,7 +913,7 @@ static void synchronize() {
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  uint16_t global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -658,28 +939,33 @@ static void super_(bool _) {
   }
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  uint16_t name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
-  if (match(TOKEN_LEFT_PAREN)) {
+  // OP_SUPER_INVOKE has no long form, so a call through a long name binds the
+  // method and leaves the call to the usual rule
+  if (name <= UINT8_MAX && match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    current->lastCall = currentChunk()->count;
+    emitBytes(OP_SUPER_INVOKE, (uint8_t)name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  uint16_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
+  uint16_t global =
+      current->scopeDepth > 0 ? 0 : globalVariable(&parser.previous);
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -782,10 +1068,136 @@ static void subscript(bool canAssign) {
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
+// Mirrors BINARY_OP, BOOLEAN_OP and BITWISE_OP in the VM. Anything that
+// would raise a runtime error or hit undefined behaviour is left alone.
+static bool foldBinary(TokenType op, Value a, Value b, Value *result) {
+  if (op == TOKEN_EQUAL_EQUAL || op == TOKEN_BANG_EQUAL) {
+    *result = BOOL_VAL(valuesEqual(a, b) == (op == TOKEN_EQUAL_EQUAL));
+    return true;
+  }
+  if (op == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    ObjString *left = AS_STRING(a);
+    ObjString *right = AS_STRING(b);
+    ObjString *string = allocateString(left->length + right->length);
+    memcpy(string->chars, left->chars, left->length);
+    memcpy(string->chars + left->length, right->chars, right->length);
+    *result = OBJ_VAL(internString(string));
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  if (IS_INTEGER(a) && IS_INTEGER(b)) {
+    long x = AS_INTEGER(a);
+    long y = AS_INTEGER(b);
+    char arithmetic = 0;
+    switch (op) {
+    case TOKEN_PLUS:
+      arithmetic = '+';
+      break;
+    case TOKEN_MINUS:
+      arithmetic = '-';
+      break;
+    case TOKEN_STAR:
+      arithmetic = '*';
+      break;
+    case TOKEN_SLASH:
+      if (y == 0 || (x == LONG_MIN && y == -1)) {
+        return false;
+      }
+      arithmetic = '/';
+      break;
+    case TOKEN_AMPERSAND:
+      arithmetic = '&';
+      break;
+    case TOKEN_PIPE:
+      arithmetic = '|';
+      break;
+    case TOKEN_CARET:
+      arithmetic = '^';
+      break;
+    case TOKEN_LESS_LESS:
+      if (y < 0 || y >= 64) {
+        return false;
+      }
+      arithmetic = '<';
+      break;
+    case TOKEN_GREATER_GREATER:
+      if (y < 0 || y >= 64) {
+        return false;
+      }
+      arithmetic = '>';
+      break;
+    case TOKEN_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case TOKEN_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case TOKEN_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case TOKEN_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    default:
+      return false;
+    }
+    // A result out of range is left for the VM to report
+    long folded;
+    if (!integerArithmetic(arithmetic, x, y, &folded)) {
+      return false;
+    }
+    *result = INTEGER_VAL(folded);
+    return true;
+  }
+  double x = IS_INTEGER(a) ? (double)AS_INTEGER(a) : AS_FLOATING(a);
+  double y = IS_INTEGER(b) ? (double)AS_INTEGER(b) : AS_FLOATING(b);
+  switch (op) {
+  case TOKEN_PLUS:
+    *result = FLOAT_VAL(x + y);
+    return true;
+  case TOKEN_MINUS:
+    *result = FLOAT_VAL(x - y);
+    return true;
+  case TOKEN_STAR:
+    *result = FLOAT_VAL(x * y);
+    return true;
+  case TOKEN_SLASH:
+    *result = FLOAT_VAL(x / y);
+    return true;
+  case TOKEN_GREATER:
+    *result = BOOL_VAL(x > y);
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *result = BOOL_VAL(!(x < y));
+    return true;
+  case TOKEN_LESS:
+    *result = BOOL_VAL(x < y);
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *result = BOOL_VAL(!(x > y));
+    return true;
+  default:
+    return false;
+  }
+}
+
 static void binary(bool _) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+  ConstantExpr left, right;
+  bool leftConstant = constantFrom(parser.operandStart, &left);
+  int rightStart = currentChunk()->count;
   parsePrecedence((Precedence)(rule->precedence + 1));
+  Value result;
+  if (leftConstant && constantFrom(rightStart, &right) &&
+      foldBinary(operatorType, left.value, right.value, &result)) {
+    discardConstant(&right);
+    discardConstant(&left);
+    emitLiteral(result);
+    return;
+  }
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
     emitBytes(OP_EQUAL, OP_NOT);
@@ -830,7 +1242,7 @@ static void binary(bool _) {
     emitByte(OP_LSR);
     break;
   case TOKEN_LESS_LESS:
-    emitByte(OP_LSR);
+    emitByte(OP_LSL);
     break;
   default:
     return;
@@ -839,35 +1251,42 @@ static void binary(bool _) {
 
 static void call(bool _) {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  uint16_t name = identifierConstant(&parser.previous);
 
+  // OP_INVOKE has no long form, so a call through a long name gets the
+  // property and leaves the call to the usual rule
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
+    emitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+    emitCache();
+  } else if (name <= UINT8_MAX && match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    current->lastCall = currentChunk()->count;
+    emitBytes(OP_INVOKE, (uint8_t)name);
     emitByte(argCount);
+    emitCache();
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+    emitCache();
   }
 }
 
 static void literal(bool _) {
   switch (parser.previous.type) {
   case TOKEN_FALSE:
-    emitByte(OP_FALSE);
+    emitLiteral(BOOL_VAL(false));
     break;
   case TOKEN_TRUE:
-    emitByte(OP_TRUE);
+    emitLiteral(BOOL_VAL(true));
     break;
   case TOKEN_NIL:
-    emitByte(OP_NIL);
+    emitLiteral(NIL_VAL);
     break;
   default:
     return;
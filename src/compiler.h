@@ -15,6 +15,7 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  int operandStart; // Offset of the left operand of the current infix rule
 } Parser;
 
 typedef enum {
@@ -58,18 +59,45 @@ typedef enum {
 } FunctionType;
 
 typedef struct {
-  uint8_t index;
+  uint16_t index;
   bool isLocal;
 } Upvalue;
 
+// The most recent instruction that pushed a value known at compile time
+typedef struct {
+  int start;
+  int end;
+  int constant; // Index in the constant pool, or -1 for OP_TRUE and friends
+  Value value;
+  bool added; // Whether the pool entry was new rather than shared
+} ConstantExpr;
+
+// A bucket in the index from constant values to their pool entries
+typedef struct {
+  Value value;
+  int constant; // -1 when the bucket is empty
+} ConstantSlot;
+
 typedef struct Compiler {
   struct Compiler *enclosing;
   ObjFunction *function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  // Both grow on demand, up to UINT16_COUNT entries
+  Local *locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue *upvalues;
+  int upvalueCapacity;
   int scopeDepth;
+  // Lets equal strings and numbers share one pool entry. Entries are not
+  // removed when a constant is discarded, so lookups check them against the
+  // pool.
+  ConstantSlot *constants;
+  int constantCount;
+  int constantCapacity;
+  ConstantExpr lastConstant;
+  // Offset of the most recent call or invoke, to spot calls in tail position
+  int lastCall;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -6,6 +6,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -23,6 +24,29 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+  constant |= chunk->code[offset + 2];
+  printf("%-16s %d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d", name, slot);
+  if (slot < vm.globalNames.count) {
+    printf(" '");
+    printValue(vm.globalNames.values[slot]);
+    printf("'");
+  }
+  printf("\n");
+  return offset + 3;
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -34,6 +58,13 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int shortInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
                            int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -51,13 +82,119 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static int cachedInvokeInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 4;
+}
+
+static int propertyLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+  constant |= chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+// Upvalue operands are a byte each in OP_CLOSURE and a short in the long form
+static int closureInstruction(const char *name, Chunk *chunk, int offset,
+                              bool wide) {
+  offset++;
+  uint16_t constant = chunk->code[offset++];
+  if (wide) {
+    constant = (uint16_t)(constant << 8) | chunk->code[offset++];
+  }
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int j = 0; j < function->upvalueCount; j++) {
+    int start = offset;
+    int isLocal = chunk->code[offset++];
+    int index = chunk->code[offset++];
+    if (wide) {
+      index = (index << 8) | chunk->code[offset++];
+    }
+    printf("%04d      |                     %s %d\n", start,
+           isLocal ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
+static int incrementInstruction(const char *name, Chunk *chunk,
+                                int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d += '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int localPropertyInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s %4d '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("' (cache %d)\n", cache);
+  return offset + 5;
+}
+
+// Register forms: operand bytes are frame slots, except for a trailing
+// constant index (K) or jump offset
+static int registerInstruction(const char *name, Chunk *chunk, int offset,
+                               int locals, bool constant, int sign) {
+  printf("%-16s", name);
+  int end = offset + 1;
+  for (int i = 0; i < locals; i++) {
+    printf(" %4d", chunk->code[end++]);
+  }
+  if (constant) {
+    printf(" '");
+    printValue(chunk->constants.values[chunk->code[end++]]);
+    printf("'");
+  }
+  if (sign != 0) {
+    uint16_t jump = (uint16_t)(chunk->code[end] << 8);
+    jump |= chunk->code[end + 1];
+    end += 2;
+    printf(" -> %d", end + sign * jump);
+  }
+  printf("\n");
+  return end;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -76,22 +213,34 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_INCREMENT_LOCAL:
+    return incrementInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+  case OP_GET_LOCAL_INDEX:
+    return byteInstruction("OP_GET_LOCAL_INDEX", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_INDEX_SUBSCR:
     return simpleInstruction("OP_INDEX_SUBSCR", offset);
   case OP_STORE_SUBSCR:
     return simpleInstruction("OP_STORE_SUBSCR", offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
     return simpleInstruction("OP_GREATER", offset);
   case OP_LESS:
     return simpleInstruction("OP_LESS", offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
   case OP_ADD:
     return simpleInstruction("OP_ADD", offset);
   case OP_SUBTRACT:
@@ -114,6 +263,75 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_NOT", offset);
   case OP_NEGATE:
     return simpleInstruction("OP_NEGATE", offset);
+  case OP_ADD_INT:
+    return simpleInstruction("OP_ADD_INT", offset);
+  case OP_ADD_FLOAT:
+    return simpleInstruction("OP_ADD_FLOAT", offset);
+  case OP_SUBTRACT_INT:
+    return simpleInstruction("OP_SUBTRACT_INT", offset);
+  case OP_SUBTRACT_FLOAT:
+    return simpleInstruction("OP_SUBTRACT_FLOAT", offset);
+  case OP_MULTIPLY_INT:
+    return simpleInstruction("OP_MULTIPLY_INT", offset);
+  case OP_MULTIPLY_FLOAT:
+    return simpleInstruction("OP_MULTIPLY_FLOAT", offset);
+  case OP_GREATER_INT:
+    return simpleInstruction("OP_GREATER_INT", offset);
+  case OP_GREATER_FLOAT:
+    return simpleInstruction("OP_GREATER_FLOAT", offset);
+  case OP_LESS_INT:
+    return simpleInstruction("OP_LESS_INT", offset);
+  case OP_LESS_FLOAT:
+    return simpleInstruction("OP_LESS_FLOAT", offset);
+  case OP_GREATER_JUMP_INT:
+    return jumpInstruction("OP_GREATER_JUMP_INT", 1, chunk, offset);
+  case OP_GREATER_JUMP_FLOAT:
+    return jumpInstruction("OP_GREATER_JUMP_FLOAT", 1, chunk, offset);
+  case OP_LESS_JUMP_INT:
+    return jumpInstruction("OP_LESS_JUMP_INT", 1, chunk, offset);
+  case OP_LESS_JUMP_FLOAT:
+    return jumpInstruction("OP_LESS_JUMP_FLOAT", 1, chunk, offset);
+  case OP_ADD_GENERIC:
+    return simpleInstruction("OP_ADD_GENERIC", offset);
+  case OP_SUBTRACT_GENERIC:
+    return simpleInstruction("OP_SUBTRACT_GENERIC", offset);
+  case OP_MULTIPLY_GENERIC:
+    return simpleInstruction("OP_MULTIPLY_GENERIC", offset);
+  case OP_GREATER_GENERIC:
+    return simpleInstruction("OP_GREATER_GENERIC", offset);
+  case OP_LESS_GENERIC:
+    return simpleInstruction("OP_LESS_GENERIC", offset);
+  case OP_GREATER_JUMP_GENERIC:
+    return jumpInstruction("OP_GREATER_JUMP_GENERIC", 1, chunk, offset);
+  case OP_LESS_JUMP_GENERIC:
+    return jumpInstruction("OP_LESS_JUMP_GENERIC", 1, chunk, offset);
+  case OP_ADD_LL:
+    return registerInstruction("OP_ADD_LL", chunk, offset, 2, false, 0);
+  case OP_ADD_LK:
+    return registerInstruction("OP_ADD_LK", chunk, offset, 1, true, 0);
+  case OP_ADD_LLL:
+    return registerInstruction("OP_ADD_LLL", chunk, offset, 3, false, 0);
+  case OP_ADD_LLK:
+    return registerInstruction("OP_ADD_LLK", chunk, offset, 2, true, 0);
+  case OP_SUBTRACT_LL:
+    return registerInstruction("OP_SUBTRACT_LL", chunk, offset, 2, false, 0);
+  case OP_SUBTRACT_LK:
+    return registerInstruction("OP_SUBTRACT_LK", chunk, offset, 1, true, 0);
+  case OP_SUBTRACT_LLL:
+    return registerInstruction("OP_SUBTRACT_LLL", chunk, offset, 3, false, 0);
+  case OP_SUBTRACT_LLK:
+    return registerInstruction("OP_SUBTRACT_LLK", chunk, offset, 2, true, 0);
+  case OP_LESS_JUMP_LL:
+    return registerInstruction("OP_LESS_JUMP_LL", chunk, offset, 2, false, 1);
+  case OP_LESS_JUMP_LK:
+    return registerInstruction("OP_LESS_JUMP_LK", chunk, offset, 1, true, 1);
+  case OP_GREATER_JUMP_LL:
+    return registerInstruction("OP_GREATER_JUMP_LL", chunk, offset, 2, false,
+                               1);
+  case OP_GREATER_JUMP_LK:
+    return registerInstruction("OP_GREATER_JUMP_LK", chunk, offset, 1, true, 1);
+  case OP_MOVE:
+    return registerInstruction("OP_MOVE", chunk, offset, 2, false, 0);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
@@ -126,43 +344,72 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_EQUAL_JUMP:
+    return jumpInstruction("OP_EQUAL_JUMP", 1, chunk, offset);
+  case OP_NOT_EQUAL_JUMP:
+    return jumpInstruction("OP_NOT_EQUAL_JUMP", 1, chunk, offset);
+  case OP_GREATER_JUMP:
+    return jumpInstruction("OP_GREATER_JUMP", 1, chunk, offset);
+  case OP_GREATER_EQUAL_JUMP:
+    return jumpInstruction("OP_GREATER_EQUAL_JUMP", 1, chunk, offset);
+  case OP_LESS_JUMP:
+    return jumpInstruction("OP_LESS_JUMP", 1, chunk, offset);
+  case OP_LESS_EQUAL_JUMP:
+    return jumpInstruction("OP_LESS_EQUAL_JUMP", 1, chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_GET_LOCAL_PROPERTY:
+    return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
   case OP_INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
   case OP_GET_SUPER:
     return constantInstruction("OP_GET_SUPER", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    printValue(chunk->constants.values[constant]);
-    printf("\n");
-    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-    for (int j = 0; j < function->upvalueCount; j++) {
-      int isLocal = chunk->code[offset++];
-      int index = chunk->code[offset++];
-      printf("%04d      |                     %s %d\n", offset - 2,
-             isLocal ? "local" : "upvalue", index);
-    }
-    return offset;
-  }
+  case OP_CLOSURE:
+    return closureInstruction("OP_CLOSURE", chunk, offset, false);
   case OP_INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return cachedInvokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+  case OP_TAIL_SUPER_INVOKE:
+    return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
   case OP_CLASS:
     return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_GET_LOCAL_LONG:
+    return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+  case OP_GET_UPVALUE_LONG:
+    return shortInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+  case OP_SET_UPVALUE_LONG:
+    return shortInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return propertyLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return propertyLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_GET_SUPER_LONG:
+    return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return closureInstruction("OP_CLOSURE_LONG", chunk, offset, true);
+  case OP_CLASS_LONG:
+    return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+  case OP_METHOD_LONG:
+    return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
   default:
     printf("Unknown opcode: %d\n", instruction);
     return offset + 1;
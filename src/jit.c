@@ -0,0 +1,823 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// A baseline compiler that stitches a fixed x86-64 template for each
+// instruction. Native code works on the same value stack and frame slots as
+// the interpreter. Anything it does not handle, and any guard that fails,
+// exits back to the interpreter at the start of the instruction, so native
+// code never allocates, calls into the VM or reports errors itself.
+//
+// While native code runs, r12 holds the frame's slots, r13 the stack top and
+// rbx the address the stack top is written back to on exit.
+
+typedef enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+} Register;
+
+#define XMM0 0
+#define XMM1 1
+
+// Condition codes as encoded in jcc and setcc
+typedef enum {
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_L = 0xc,
+  CC_GE = 0xd,
+  CC_LE = 0xe,
+  CC_G = 0xf,
+} Condition;
+
+#define INVERT(cc) ((Condition)((cc) ^ 1))
+#define JMP (-1)
+
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#define PAYLOAD_OFFSET ((int32_t)offsetof(Value, as))
+#define SLOT(index) ((int32_t)sizeof(Value) * (index))
+#define STACK(distance) (-(int32_t)sizeof(Value) * ((distance) + 1))
+
+typedef struct {
+  int at;     // Position of the rel32 to patch
+  int target; // Bytecode offset to branch to, or to exit at
+  bool exit;
+} Fixup;
+
+typedef struct {
+  Chunk *chunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *entries;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  int offset; // Bytecode offset of the instruction being compiled
+  int exit;   // Position of the shared exit sequence
+} Jit;
+
+// An instruction operand: either the value at [base + disp] or a constant
+// known at compile time
+typedef struct {
+  bool isConstant;
+  Value value;
+  Register base;
+  int32_t disp;
+} Operand;
+
+typedef enum { ARITH_ADD, ARITH_SUBTRACT, ARITH_MULTIPLY } Arithmetic;
+
+typedef enum {
+  CMP_EQUAL,
+  CMP_NOT_EQUAL,
+  CMP_GREATER,
+  CMP_GREATER_EQUAL,
+  CMP_LESS,
+  CMP_LESS_EQUAL,
+} Comparison;
+
+static Operand memoryOperand(Register base, int32_t disp) {
+  Operand operand = {false, NIL_VAL, base, disp};
+  return operand;
+}
+
+static Operand constantOperand(Value value) {
+  Operand operand = {true, value, RAX, 0};
+  return operand;
+}
+
+#define LOCAL(index) memoryOperand(R12, SLOT(index))
+#define STACK_VALUE(distance) memoryOperand(R13, STACK(distance))
+#define CONSTANT(index) constantOperand(jit->chunk->constants.values[index])
+
+static void emitByte(Jit *jit, uint8_t byte) {
+  if (jit->capacity < jit->count + 1) {
+    int oldCapacity = jit->capacity;
+    jit->capacity = GROW_CAPACITY(oldCapacity);
+    jit->code = GROW_ARRAY(uint8_t, jit->code, oldCapacity, jit->capacity);
+  }
+  jit->code[jit->count++] = byte;
+}
+
+static void emit32(Jit *jit, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(jit, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void emit64(Jit *jit, uint64_t value) {
+  emit32(jit, (uint32_t)value);
+  emit32(jit, (uint32_t)(value >> 32));
+}
+
+// Prefix, REX and opcode. Two-byte opcodes are given as 0x0fxx.
+static void emitOpcode(Jit *jit, uint8_t prefix, bool wide, uint16_t opcode,
+                       int reg, int rm) {
+  if (prefix != 0) {
+    emitByte(jit, prefix);
+  }
+  uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+  if (rex != 0x40) {
+    emitByte(jit, rex);
+  }
+  if (opcode > 0xff) {
+    emitByte(jit, opcode >> 8);
+  }
+  emitByte(jit, opcode & 0xff);
+}
+
+// opcode reg, [base + disp32]
+static void emitMemory(Jit *jit, uint8_t prefix, bool wide, uint16_t opcode,
+                       int reg, Register base, int32_t disp) {
+  emitOpcode(jit, prefix, wide, opcode, reg, base);
+  emitByte(jit, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) {
+    emitByte(jit, 0x24);
+  }
+  emit32(jit, (uint32_t)disp);
+}
+
+// opcode reg, rm
+static void emitRegisters(Jit *jit, uint8_t prefix, bool wide, uint16_t opcode,
+                          int reg, int rm) {
+  emitOpcode(jit, prefix, wide, opcode, reg, rm);
+  emitByte(jit, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void emitPush(Jit *jit, Register reg) {
+  emitOpcode(jit, 0, false, 0x50 + (reg & 7), 0, reg);
+}
+
+static void emitPop(Jit *jit, Register reg) {
+  emitOpcode(jit, 0, false, 0x58 + (reg & 7), 0, reg);
+}
+
+static void emitLoad(Jit *jit, Register reg, Register base, int32_t disp) {
+  emitMemory(jit, 0, true, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Jit *jit, Register base, int32_t disp, Register reg) {
+  emitMemory(jit, 0, true, 0x89, reg, base, disp);
+}
+
+static void emitImmediate(Jit *jit, Register reg, uint64_t value) {
+  emitOpcode(jit, 0, true, 0xb8 + (reg & 7), 0, reg);
+  emit64(jit, value);
+}
+
+// Compares the type of the value at [base + disp] with type
+static void emitTypeCheck(Jit *jit, Register base, int32_t disp,
+                          ValueType type) {
+  emitMemory(jit, 0, false, 0x83, 7, base, disp + TYPE_OFFSET);
+  emitByte(jit, (uint8_t)type);
+}
+
+static void emitStoreType(Jit *jit, Register base, int32_t disp,
+                          ValueType type) {
+  emitMemory(jit, 0, false, 0xc7, 0, base, disp + TYPE_OFFSET);
+  emit32(jit, (uint32_t)type);
+}
+
+// Moves the stack top by count values without touching the flags
+static void emitAdjustStack(Jit *jit, int count) {
+  if (count != 0) {
+    emitMemory(jit, 0, true, 0x8d, R13, R13, SLOT(count));
+  }
+}
+
+// Values are copied as two quadwords: the type (and its padding), then the
+// payload
+static void emitCopy(Jit *jit, Register dst, int32_t dstDisp, Register src,
+                     int32_t srcDisp) {
+  emitLoad(jit, RAX, src, srcDisp);
+  emitLoad(jit, RCX, src, srcDisp + 8);
+  emitStore(jit, dst, dstDisp, RAX);
+  emitStore(jit, dst, dstDisp + 8, RCX);
+}
+
+// A jmp (cc is JMP) or jcc whose target is filled in later. Returns the
+// position of its rel32.
+static int emitJump(Jit *jit, int cc) {
+  if (cc == JMP) {
+    emitByte(jit, 0xe9);
+  } else {
+    emitByte(jit, 0x0f);
+    emitByte(jit, 0x80 | cc);
+  }
+  emit32(jit, 0);
+  return jit->count - 4;
+}
+
+static void patchJump(Jit *jit, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(jit->code + at, &rel, sizeof(rel));
+}
+
+static void addFixup(Jit *jit, int at, int target, bool exit) {
+  if (jit->fixupCapacity < jit->fixupCount + 1) {
+    int oldCapacity = jit->fixupCapacity;
+    jit->fixupCapacity = GROW_CAPACITY(oldCapacity);
+    jit->fixups =
+        GROW_ARRAY(Fixup, jit->fixups, oldCapacity, jit->fixupCapacity);
+  }
+  Fixup *fixup = &jit->fixups[jit->fixupCount++];
+  fixup->at = at;
+  fixup->target = target;
+  fixup->exit = exit;
+}
+
+static void emitBranch(Jit *jit, int cc, int target) {
+  addFixup(jit, emitJump(jit, cc), target, false);
+}
+
+// Leaves native code at the current instruction when cc holds
+static void emitExitIf(Jit *jit, int cc) {
+  addFixup(jit, emitJump(jit, cc), jit->offset, true);
+}
+
+static void emitExitTo(Jit *jit, int offset) {
+  emitByte(jit, 0xb8);
+  emit32(jit, (uint32_t)offset);
+  patchJump(jit, emitJump(jit, JMP), jit->exit);
+}
+
+static void emitPayload(Jit *jit, Register reg, Operand operand) {
+  if (!operand.isConstant) {
+    emitLoad(jit, reg, operand.base, operand.disp + PAYLOAD_OFFSET);
+    return;
+  }
+  uint64_t bits = 0;
+  if (IS_BOOL(operand.value)) {
+    bits = AS_BOOL(operand.value);
+  } else if (!IS_NIL(operand.value)) {
+    memcpy(&bits, &operand.value.as, sizeof(bits));
+  }
+  emitImmediate(jit, reg, bits);
+}
+
+static void emitStoreValue(Jit *jit, Operand dst, Register reg,
+                           ValueType type) {
+  emitStore(jit, dst.base, dst.disp + PAYLOAD_OFFSET, reg);
+  emitStoreType(jit, dst.base, dst.disp, type);
+}
+
+// Exits unless the operand has the given type. Constants are checked when
+// the template is chosen, so they need no guard.
+static void emitGuard(Jit *jit, Operand operand, ValueType type) {
+  if (!operand.isConstant) {
+    emitTypeCheck(jit, operand.base, operand.disp, type);
+    emitExitIf(jit, CC_NE);
+  }
+}
+
+static void emitPushConstant(Jit *jit, Value value) {
+  Operand top = memoryOperand(R13, 0);
+  emitPayload(jit, RAX, constantOperand(value));
+  emitStoreValue(jit, top, RAX, VALUE_TYPE(value));
+  emitAdjustStack(jit, 1);
+}
+
+// dst = a op b for two integers or two floats. Constant operands only get
+// the template for their own type; everything else exits.
+static void emitArithmetic(Jit *jit, Arithmetic op, Operand a, Operand b,
+                           Operand dst) {
+  static const uint16_t intOps[] = {0x03, 0x2b, 0x0faf};
+  static const uint16_t floatOps[] = {0x0f58, 0x0f5c, 0x0f59};
+  bool integers = !b.isConstant || IS_INTEGER(b.value);
+  bool floats = !b.isConstant || IS_FLOATING(b.value);
+  if (!integers && !floats) {
+    emitExitTo(jit, jit->offset);
+    return;
+  }
+
+  int floatPath = -1;
+  int done = -1;
+  if (integers) {
+    emitTypeCheck(jit, a.base, a.disp, VAL_INTEGER);
+    if (floats) {
+      floatPath = emitJump(jit, CC_NE);
+    } else {
+      emitExitIf(jit, CC_NE);
+    }
+    emitGuard(jit, b, VAL_INTEGER);
+    emitPayload(jit, RAX, a);
+    emitPayload(jit, RCX, b);
+    emitRegisters(jit, 0, true, intOps[op], RAX, RCX);
+    emitStoreValue(jit, dst, RAX, VAL_INTEGER);
+    if (floats) {
+      done = emitJump(jit, JMP);
+    }
+  }
+  if (floats) {
+    if (floatPath >= 0) {
+      patchJump(jit, floatPath, jit->count);
+    }
+    emitGuard(jit, a, VAL_FLOAT);
+    emitGuard(jit, b, VAL_FLOAT);
+    emitPayload(jit, RAX, a);
+    emitPayload(jit, RCX, b);
+    emitRegisters(jit, 0x66, true, 0x0f6e, XMM0, RAX);
+    emitRegisters(jit, 0x66, true, 0x0f6e, XMM1, RCX);
+    emitRegisters(jit, 0xf2, false, floatOps[op], XMM0, XMM1);
+    emitRegisters(jit, 0x66, true, 0x0f7e, XMM0, RAX);
+    emitStoreValue(jit, dst, RAX, VAL_FLOAT);
+  }
+  if (done >= 0) {
+    patchJump(jit, done, jit->count);
+  }
+}
+
+// Turns the comparison left in the flags into a result. With a target the
+// operands are popped and control branches there if the result is false;
+// without one the two operands on the stack are replaced by a boolean.
+static void emitCompareResult(Jit *jit, Condition cc, int pops, int target) {
+  if (target < 0) {
+    emitRegisters(jit, 0, false, 0x0f90 | cc, 0, RAX);
+    emitRegisters(jit, 0, false, 0x0fb6, RAX, RAX);
+    emitStoreValue(jit, STACK_VALUE(1), RAX, VAL_BOOL);
+    emitAdjustStack(jit, -1);
+  } else {
+    emitAdjustStack(jit, -pops);
+    emitBranch(jit, INVERT(cc), target);
+  }
+}
+
+// Greater-equal and less-equal are !(a < b) and !(a > b), so they are true
+// for a NaN operand, the same as in the interpreter.
+static void emitComparison(Jit *jit, Comparison cmp, Operand a, Operand b,
+                           int pops, int target) {
+  static const Condition intConditions[] = {CC_E, CC_NE, CC_G,
+                                            CC_GE, CC_L, CC_LE};
+  bool integers = !b.isConstant || IS_INTEGER(b.value);
+  bool floats = cmp != CMP_EQUAL && cmp != CMP_NOT_EQUAL &&
+                (!b.isConstant || IS_FLOATING(b.value));
+  if (!integers && !floats) {
+    emitExitTo(jit, jit->offset);
+    return;
+  }
+
+  int floatPath = -1;
+  int done = -1;
+  if (integers) {
+    emitTypeCheck(jit, a.base, a.disp, VAL_INTEGER);
+    if (floats) {
+      floatPath = emitJump(jit, CC_NE);
+    } else {
+      emitExitIf(jit, CC_NE);
+    }
+    emitGuard(jit, b, VAL_INTEGER);
+    emitPayload(jit, RAX, a);
+    emitPayload(jit, RCX, b);
+    emitRegisters(jit, 0, true, 0x3b, RAX, RCX);
+    emitCompareResult(jit, intConditions[cmp], pops, target);
+    if (floats) {
+      done = emitJump(jit, JMP);
+    }
+  }
+  if (floats) {
+    if (floatPath >= 0) {
+      patchJump(jit, floatPath, jit->count);
+    }
+    emitGuard(jit, a, VAL_FLOAT);
+    emitGuard(jit, b, VAL_FLOAT);
+    emitPayload(jit, RAX, a);
+    emitPayload(jit, RCX, b);
+    emitRegisters(jit, 0x66, true, 0x0f6e, XMM0, RAX);
+    emitRegisters(jit, 0x66, true, 0x0f6e, XMM1, RCX);
+    bool swap = cmp == CMP_LESS || cmp == CMP_GREATER_EQUAL;
+    emitRegisters(jit, 0x66, false, 0x0f2e, swap ? XMM1 : XMM0,
+                  swap ? XMM0 : XMM1);
+    bool strict = cmp == CMP_GREATER || cmp == CMP_LESS;
+    emitCompareResult(jit, strict ? CC_A : CC_BE, pops, target);
+  }
+  if (done >= 0) {
+    patchJump(jit, done, jit->count);
+  }
+}
+
+// Loads the address of the global values array into rdx and exits if the
+// global in slot is undefined
+static void emitGlobalCheck(Jit *jit, int slot) {
+  emitImmediate(jit, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  emitLoad(jit, RDX, RDX, 0);
+  // An undefined global is an object value with a NULL pointer
+  emitTypeCheck(jit, RDX, SLOT(slot), VAL_OBJ);
+  int defined = emitJump(jit, CC_NE);
+  emitMemory(jit, 0, true, 0x83, 7, RDX, SLOT(slot) + PAYLOAD_OFFSET);
+  emitByte(jit, 0);
+  emitExitIf(jit, CC_E);
+  patchJump(jit, defined, jit->count);
+}
+
+// Integer-only binary operators on the top two values
+static void emitBitwise(Jit *jit, uint8_t op) {
+  emitGuard(jit, STACK_VALUE(1), VAL_INTEGER);
+  emitGuard(jit, STACK_VALUE(0), VAL_INTEGER);
+  emitPayload(jit, RAX, STACK_VALUE(1));
+  emitPayload(jit, RCX, STACK_VALUE(0));
+  switch (op) {
+  case OP_BIT_AND:
+    emitRegisters(jit, 0, true, 0x23, RAX, RCX);
+    break;
+  case OP_BIT_OR:
+    emitRegisters(jit, 0, true, 0x0b, RAX, RCX);
+    break;
+  case OP_BIT_XOR:
+    emitRegisters(jit, 0, true, 0x33, RAX, RCX);
+    break;
+  case OP_LSL:
+    emitRegisters(jit, 0, true, 0xd3, 4, RAX);
+    break;
+  case OP_LSR:
+    emitRegisters(jit, 0, true, 0xd3, 7, RAX);
+    break;
+  }
+  emitStoreValue(jit, STACK_VALUE(1), RAX, VAL_INTEGER);
+  emitAdjustStack(jit, -1);
+}
+
+static void emitNegate(Jit *jit) {
+  int32_t payload = STACK(0) + PAYLOAD_OFFSET;
+  emitTypeCheck(jit, R13, STACK(0), VAL_INTEGER);
+  int floatPath = emitJump(jit, CC_NE);
+  emitMemory(jit, 0, true, 0xf7, 3, R13, payload);
+  int done = emitJump(jit, JMP);
+  patchJump(jit, floatPath, jit->count);
+  emitTypeCheck(jit, R13, STACK(0), VAL_FLOAT);
+  emitExitIf(jit, CC_NE);
+  // Flip the sign bit
+  emitMemory(jit, 0, true, 0x0fba, 7, R13, payload);
+  emitByte(jit, 63);
+  patchJump(jit, done, jit->count);
+}
+
+// Falsey is nil, or a bool whose payload is zero
+static void emitNot(Jit *jit) {
+  emitTypeCheck(jit, R13, STACK(0), VAL_NIL);
+  emitRegisters(jit, 0, false, 0x0f94, 0, RCX);
+  emitTypeCheck(jit, R13, STACK(0), VAL_BOOL);
+  emitRegisters(jit, 0, false, 0x0f94, 0, RDX);
+  emitMemory(jit, 0, false, 0x80, 7, R13, STACK(0) + PAYLOAD_OFFSET);
+  emitByte(jit, 0);
+  emitRegisters(jit, 0, false, 0x0f94, 0, RAX);
+  emitRegisters(jit, 0, false, 0x20, RDX, RAX);
+  emitRegisters(jit, 0, false, 0x08, RCX, RAX);
+  emitRegisters(jit, 0, false, 0x0fb6, RAX, RAX);
+  emitStoreValue(jit, STACK_VALUE(0), RAX, VAL_BOOL);
+}
+
+// dst = list[index] for an integer index inside the list. Strings, negative
+// indexes and errors are left to the interpreter.
+static void emitIndex(Jit *jit, Operand list, Operand index, Operand dst) {
+  emitGuard(jit, index, VAL_INTEGER);
+  emitGuard(jit, list, VAL_OBJ);
+  emitPayload(jit, RDX, list);
+  emitMemory(jit, 0, false, 0x83, 7, RDX, (int32_t)offsetof(Obj, type));
+  emitByte(jit, OBJ_LIST);
+  emitExitIf(jit, CC_NE);
+  emitPayload(jit, RAX, index);
+  emitMemory(jit, 0, true, 0x63, RCX, RDX, (int32_t)offsetof(ObjList, count));
+  emitRegisters(jit, 0, true, 0x3b, RAX, RCX);
+  emitExitIf(jit, CC_AE);
+  emitLoad(jit, RDX, RDX, (int32_t)offsetof(ObjList, items));
+  emitRegisters(jit, 0, true, 0xc1, 4, RAX);
+  emitByte(jit, 4);
+  emitRegisters(jit, 0, true, 0x03, RDX, RAX);
+  emitCopy(jit, dst.base, dst.disp, RDX, 0);
+}
+
+static void emitJumpIfFalse(Jit *jit, int target) {
+  emitTypeCheck(jit, R13, STACK(0), VAL_NIL);
+  emitBranch(jit, CC_E, target);
+  emitTypeCheck(jit, R13, STACK(0), VAL_BOOL);
+  int truthy = emitJump(jit, CC_NE);
+  emitMemory(jit, 0, false, 0x80, 7, R13, STACK(0) + PAYLOAD_OFFSET);
+  emitByte(jit, 0);
+  emitBranch(jit, CC_E, target);
+  patchJump(jit, truthy, jit->count);
+}
+
+// Returns false if the instruction is left to the interpreter
+static bool emitInstruction(Jit *jit) {
+  uint8_t *ip = jit->chunk->code + jit->offset;
+  int next = jit->offset + instructionLength(jit->chunk, jit->offset);
+#define JUMP_TARGET (next + (uint16_t)(ip[1] << 8 | ip[2]))
+  switch (ip[0]) {
+  case OP_CONSTANT:
+    emitPushConstant(jit, jit->chunk->constants.values[ip[1]]);
+    break;
+  case OP_NIL:
+    emitPushConstant(jit, NIL_VAL);
+    break;
+  case OP_TRUE:
+    emitPushConstant(jit, BOOL_VAL(true));
+    break;
+  case OP_FALSE:
+    emitPushConstant(jit, BOOL_VAL(false));
+    break;
+  case OP_POP:
+    emitAdjustStack(jit, -1);
+    break;
+  case OP_GET_LOCAL:
+    emitCopy(jit, R13, 0, R12, SLOT(ip[1]));
+    emitAdjustStack(jit, 1);
+    break;
+  case OP_SET_LOCAL:
+    emitCopy(jit, R12, SLOT(ip[1]), R13, STACK(0));
+    break;
+  case OP_SET_LOCAL_POP:
+    emitCopy(jit, R12, SLOT(ip[1]), R13, STACK(0));
+    emitAdjustStack(jit, -1);
+    break;
+  case OP_MOVE:
+    emitCopy(jit, R12, SLOT(ip[1]), R12, SLOT(ip[2]));
+    break;
+  case OP_GET_GLOBAL:
+    emitGlobalCheck(jit, ip[1] << 8 | ip[2]);
+    emitCopy(jit, R13, 0, RDX, SLOT(ip[1] << 8 | ip[2]));
+    emitAdjustStack(jit, 1);
+    break;
+  case OP_SET_GLOBAL:
+    emitGlobalCheck(jit, ip[1] << 8 | ip[2]);
+    emitCopy(jit, RDX, SLOT(ip[1] << 8 | ip[2]), R13, STACK(0));
+    break;
+  case OP_NOT:
+    emitNot(jit);
+    break;
+  case OP_NEGATE:
+    emitNegate(jit);
+    break;
+  case OP_BIT_AND:
+  case OP_BIT_OR:
+  case OP_BIT_XOR:
+  case OP_LSL:
+  case OP_LSR:
+    emitBitwise(jit, ip[0]);
+    break;
+  case OP_INDEX_SUBSCR:
+    emitIndex(jit, STACK_VALUE(1), STACK_VALUE(0), STACK_VALUE(1));
+    emitAdjustStack(jit, -1);
+    break;
+  case OP_GET_LOCAL_INDEX:
+    emitIndex(jit, STACK_VALUE(0), LOCAL(ip[1]), STACK_VALUE(0));
+    break;
+  case OP_INCREMENT_LOCAL:
+    emitArithmetic(jit, ARITH_ADD, LOCAL(ip[1]), CONSTANT(ip[2]),
+                   LOCAL(ip[1]));
+    break;
+
+#define STACK_ARITHMETIC(op)                                                   \
+  emitArithmetic(jit, op, STACK_VALUE(1), STACK_VALUE(0), STACK_VALUE(1));     \
+  emitAdjustStack(jit, -1);                                                    \
+  break
+  case OP_ADD:
+  case OP_ADD_INT:
+  case OP_ADD_FLOAT:
+  case OP_ADD_GENERIC:
+    STACK_ARITHMETIC(ARITH_ADD);
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_INT:
+  case OP_SUBTRACT_FLOAT:
+  case OP_SUBTRACT_GENERIC:
+    STACK_ARITHMETIC(ARITH_SUBTRACT);
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_INT:
+  case OP_MULTIPLY_FLOAT:
+  case OP_MULTIPLY_GENERIC:
+    STACK_ARITHMETIC(ARITH_MULTIPLY);
+#undef STACK_ARITHMETIC
+
+#define PUSH_ARITHMETIC(op, b)                                                 \
+  emitArithmetic(jit, op, LOCAL(ip[1]), b, memoryOperand(R13, 0));             \
+  emitAdjustStack(jit, 1);                                                     \
+  break
+  case OP_ADD_LL:
+    PUSH_ARITHMETIC(ARITH_ADD, LOCAL(ip[2]));
+  case OP_ADD_LK:
+    PUSH_ARITHMETIC(ARITH_ADD, CONSTANT(ip[2]));
+  case OP_SUBTRACT_LL:
+    PUSH_ARITHMETIC(ARITH_SUBTRACT, LOCAL(ip[2]));
+  case OP_SUBTRACT_LK:
+    PUSH_ARITHMETIC(ARITH_SUBTRACT, CONSTANT(ip[2]));
+#undef PUSH_ARITHMETIC
+
+  case OP_ADD_LLL:
+    emitArithmetic(jit, ARITH_ADD, LOCAL(ip[2]), LOCAL(ip[3]), LOCAL(ip[1]));
+    break;
+  case OP_ADD_LLK:
+    emitArithmetic(jit, ARITH_ADD, LOCAL(ip[2]), CONSTANT(ip[3]),
+                   LOCAL(ip[1]));
+    break;
+  case OP_SUBTRACT_LLL:
+    emitArithmetic(jit, ARITH_SUBTRACT, LOCAL(ip[2]), LOCAL(ip[3]),
+                   LOCAL(ip[1]));
+    break;
+  case OP_SUBTRACT_LLK:
+    emitArithmetic(jit, ARITH_SUBTRACT, LOCAL(ip[2]), CONSTANT(ip[3]),
+                   LOCAL(ip[1]));
+    break;
+
+#define STACK_COMPARISON(cmp)                                                  \
+  emitComparison(jit, cmp, STACK_VALUE(1), STACK_VALUE(0), 1, -1);             \
+  break
+#define STACK_COMPARE_JUMP(cmp)                                                \
+  emitComparison(jit, cmp, STACK_VALUE(1), STACK_VALUE(0), 2,                  \
+                 JUMP_TARGET);                                                 \
+  break
+  case OP_EQUAL:
+    STACK_COMPARISON(CMP_EQUAL);
+  case OP_NOT_EQUAL:
+    STACK_COMPARISON(CMP_NOT_EQUAL);
+  case OP_GREATER:
+  case OP_GREATER_INT:
+  case OP_GREATER_FLOAT:
+  case OP_GREATER_GENERIC:
+    STACK_COMPARISON(CMP_GREATER);
+  case OP_GREATER_EQUAL:
+    STACK_COMPARISON(CMP_GREATER_EQUAL);
+  case OP_LESS:
+  case OP_LESS_INT:
+  case OP_LESS_FLOAT:
+  case OP_LESS_GENERIC:
+    STACK_COMPARISON(CMP_LESS);
+  case OP_LESS_EQUAL:
+    STACK_COMPARISON(CMP_LESS_EQUAL);
+  case OP_EQUAL_JUMP:
+    STACK_COMPARE_JUMP(CMP_EQUAL);
+  case OP_NOT_EQUAL_JUMP:
+    STACK_COMPARE_JUMP(CMP_NOT_EQUAL);
+  case OP_GREATER_JUMP:
+  case OP_GREATER_JUMP_INT:
+  case OP_GREATER_JUMP_FLOAT:
+  case OP_GREATER_JUMP_GENERIC:
+    STACK_COMPARE_JUMP(CMP_GREATER);
+  case OP_GREATER_EQUAL_JUMP:
+    STACK_COMPARE_JUMP(CMP_GREATER_EQUAL);
+  case OP_LESS_JUMP:
+  case OP_LESS_JUMP_INT:
+  case OP_LESS_JUMP_FLOAT:
+  case OP_LESS_JUMP_GENERIC:
+    STACK_COMPARE_JUMP(CMP_LESS);
+  case OP_LESS_EQUAL_JUMP:
+    STACK_COMPARE_JUMP(CMP_LESS_EQUAL);
+#undef STACK_COMPARISON
+#undef STACK_COMPARE_JUMP
+
+  case OP_LESS_JUMP_LL:
+  case OP_LESS_JUMP_LK:
+  case OP_GREATER_JUMP_LL:
+  case OP_GREATER_JUMP_LK: {
+    bool less = ip[0] == OP_LESS_JUMP_LL || ip[0] == OP_LESS_JUMP_LK;
+    bool constant = ip[0] == OP_LESS_JUMP_LK || ip[0] == OP_GREATER_JUMP_LK;
+    emitComparison(jit, less ? CMP_LESS : CMP_GREATER, LOCAL(ip[1]),
+                   constant ? CONSTANT(ip[2]) : LOCAL(ip[2]), 0,
+                   next + (uint16_t)(ip[3] << 8 | ip[4]));
+    break;
+  }
+  case OP_JUMP:
+    emitBranch(jit, JMP, JUMP_TARGET);
+    break;
+  case OP_JUMP_IF_FALSE:
+    emitJumpIfFalse(jit, JUMP_TARGET);
+    break;
+  case OP_LOOP:
+    emitBranch(jit, JMP, next - (uint16_t)(ip[1] << 8 | ip[2]));
+    break;
+  default:
+    emitExitTo(jit, jit->offset);
+    return false;
+  }
+#undef JUMP_TARGET
+  return true;
+}
+
+// Entered as int (*)(Value *slots, Value **stackTop, uint8_t *start). Saves
+// the registers native code uses and jumps to start. The shared exit follows:
+// it expects the bytecode offset to resume at in eax.
+static void emitPrologue(Jit *jit) {
+  emitPush(jit, RBX);
+  emitPush(jit, R12);
+  emitPush(jit, R13);
+  emitRegisters(jit, 0, true, 0x89, RDI, R12);
+  emitRegisters(jit, 0, true, 0x89, RSI, RBX);
+  emitLoad(jit, R13, RSI, 0);
+  emitRegisters(jit, 0, false, 0xff, 4, RDX);
+
+  jit->exit = jit->count;
+  emitStore(jit, RBX, 0, R13);
+  emitPop(jit, R13);
+  emitPop(jit, R12);
+  emitPop(jit, RBX);
+  emitByte(jit, 0xc3);
+}
+
+void compileNative(ObjFunction *function) {
+  Jit jit;
+  jit.chunk = &function->chunk;
+  jit.code = NULL;
+  jit.count = 0;
+  jit.capacity = 0;
+  jit.fixups = NULL;
+  jit.fixupCount = 0;
+  jit.fixupCapacity = 0;
+  jit.entries = ALLOCATE(int, jit.chunk->count);
+  // How many instructions native code runs from each one before it has to
+  // hand an instruction to the interpreter
+  int *runs = ALLOCATE(int, jit.chunk->count);
+  for (int i = 0; i < jit.chunk->count; i++) {
+    jit.entries[i] = -1;
+    runs[i] = 0;
+  }
+
+  emitPrologue(&jit);
+  for (jit.offset = 0; jit.offset < jit.chunk->count;
+       jit.offset += instructionLength(jit.chunk, jit.offset)) {
+    jit.entries[jit.offset] = jit.count;
+    runs[jit.offset] = emitInstruction(&jit) ? 1 : 0;
+  }
+  for (int i = 0; i < jit.fixupCount; i++) {
+    Fixup *fixup = &jit.fixups[i];
+    if (fixup->exit) {
+      patchJump(&jit, fixup->at, jit.count);
+      emitExitTo(&jit, fixup->target);
+    } else {
+      patchJump(&jit, fixup->at, jit.entries[fixup->target]);
+    }
+  }
+
+  // Entering native code costs about as much as dispatching a few
+  // instructions, so only places that run for a while are entry points
+  bool worthwhile = false;
+  for (int offset = jit.chunk->count - 1; offset >= 0; offset--) {
+    if (jit.entries[offset] < 0) {
+      continue;
+    }
+    int next = offset + instructionLength(jit.chunk, offset);
+    if (runs[offset] > 0 && next < jit.chunk->count) {
+      runs[offset] += runs[next];
+    }
+    if (runs[offset] < JIT_MIN_RUN) {
+      jit.entries[offset] = -1;
+    } else {
+      worthwhile = true;
+    }
+  }
+  FREE_ARRAY(int, runs, jit.chunk->count);
+
+  uint8_t *code = MAP_FAILED;
+  if (worthwhile) {
+    code = mmap(NULL, jit.count, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (code != MAP_FAILED) {
+    memcpy(code, jit.code, jit.count);
+    if (mprotect(code, jit.count, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, jit.count);
+      code = MAP_FAILED;
+    }
+  }
+  if (code == MAP_FAILED) {
+    // Stay in the interpreter
+    FREE_ARRAY(int, jit.entries, jit.chunk->count);
+  } else {
+    NativeCode *native = ALLOCATE(NativeCode, 1);
+    native->code = code;
+    native->size = jit.count;
+    native->entries = jit.entries;
+    native->count = jit.chunk->count;
+    function->native = native;
+  }
+  FREE_ARRAY(uint8_t, jit.code, jit.capacity);
+  FREE_ARRAY(Fixup, jit.fixups, jit.fixupCapacity);
+}
+
+void freeNative(ObjFunction *function) {
+  NativeCode *native = function->native;
+  if (native == NULL) {
+    return;
+  }
+  munmap(native->code, native->size);
+  FREE_ARRAY(int, native->entries, native->count);
+  FREE(NativeCode, native);
+  function->native = NULL;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#ifdef JIT
+
+// Calls plus loop back-edges a function takes before it is compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// Instructions native code must be able to run from a point for it to be
+// entered there
+#ifndef JIT_MIN_RUN
+#define JIT_MIN_RUN 8
+#endif
+
+typedef struct NativeCode {
+  uint8_t *code;
+  size_t size;
+  // Where native code for each instruction starts, or -1 where it should not
+  // be entered
+  int *entries;
+  int count;
+} NativeCode;
+
+typedef int (*NativeEntry)(Value *slots, Value **stackTop, uint8_t *start);
+
+void compileNative(ObjFunction *function);
+void freeNative(ObjFunction *function);
+
+// Counts a call or loop back-edge. True when the function has just become hot
+// enough to compile.
+static inline bool warmUp(ObjFunction *function) {
+  return ++function->hotness == JIT_THRESHOLD;
+}
+
+// Runs native code from the instruction at offset, which must have an entry,
+// and returns the offset the interpreter should resume at
+static inline int runNative(NativeCode *native, Value *slots, Value **stackTop,
+                            int offset) {
+  NativeEntry entry = (NativeEntry)(void *)native->code;
+  return entry(slots, stackTop, native->code + native->entries[offset]);
+}
+
+#endif
+
+#endif
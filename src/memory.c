@@ -2,7 +2,9 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "pactb.h"
 #include "src/object.h"
 #include "table.h"
 #include "value.h"
@@ -13,15 +15,72 @@
 #include <stdio.h>
 #endif
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+#else
+#define POISON(pointer, size) ((void)(pointer), (void)(size))
+#define UNPOISON(pointer, size) ((void)(pointer), (void)(size))
+#endif
+
+// Objects are carved out of slabs, one size class per POOL_GRANULE bytes.
+// Each class bumps through its current slab and reuses freed slots through
+// a free list threaded through the slots themselves.
+typedef struct PoolSlot {
+  struct PoolSlot *next;
+} PoolSlot;
+
+typedef struct Slab {
+  struct Slab *next;
+} Slab;
+
+typedef struct {
+  PoolSlot *freeList;
+  char *bump;
+  char *end;
+} Pool;
+
+#define POOL_CLASS(size) (((size) + POOL_GRANULE - 1) / POOL_GRANULE - 1)
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+// Keeps slots after the slab header aligned like malloc would
+#define SLAB_HEADER POOL_GRANULE
+
+static Pool pools[POOL_CLASSES];
+static Slab *slabs = NULL;
+
+static void collectIfNeeded() {
+#ifdef GC_INCREMENTAL
 #ifdef DEBUG_STRESS_GC
+  collectStep();
+#else
+  if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+    collectStep();
+  }
+#endif
+#else
+#ifdef DEBUG_STRESS_GC
+#ifdef GC_GENERATIONAL
+  collectYoung();
+#else
+  collectGarbage();
+#endif
+#endif
+  if (vm.bytesAllocated > vm.nextGC) {
     collectGarbage();
+  }
+#ifdef GC_GENERATIONAL
+  else if (vm.bytesAllocated > vm.nextYoungGC) {
+    collectYoung();
+  }
 #endif
-    if (vm.bytesAllocated > vm.nextGC) {
-      collectGarbage();
-    }
+#endif
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    collectIfNeeded();
   }
   if (newSize == 0) {
     free(pointer);
@@ -34,12 +93,91 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+static void refillPool(Pool *pool) {
+  Slab *slab = (Slab *)malloc(POOL_SLAB_SIZE);
+  if (slab == NULL) {
+    exit(1);
+  }
+  slab->next = slabs;
+  slabs = slab;
+  pool->bump = (char *)slab + SLAB_HEADER;
+  pool->end = (char *)slab + POOL_SLAB_SIZE;
+  POISON(pool->bump, pool->end - pool->bump);
+}
+
+void *allocateBlock(size_t size) {
+  vm.bytesAllocated += size;
+  collectIfNeeded();
+  if (size > POOL_MAX_SIZE) {
+    void *result = malloc(size);
+    if (result == NULL) {
+      exit(1);
+    }
+    return result;
+  }
+  int sizeClass = POOL_CLASS(size);
+  size_t slotSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+  Pool *pool = &pools[sizeClass];
+  PoolSlot *slot = pool->freeList;
+  if (slot) {
+    UNPOISON(slot, slotSize);
+    pool->freeList = slot->next;
+    return slot;
+  }
+  if ((size_t)(pool->end - pool->bump) < slotSize) {
+    refillPool(pool);
+  }
+  void *result = pool->bump;
+  pool->bump += slotSize;
+  UNPOISON(result, slotSize);
+  return result;
+}
+
+void freeBlock(void *pointer, size_t size) {
+  vm.bytesAllocated -= size;
+  if (size > POOL_MAX_SIZE) {
+    free(pointer);
+    return;
+  }
+  int sizeClass = POOL_CLASS(size);
+  Pool *pool = &pools[sizeClass];
+  PoolSlot *slot = (PoolSlot *)pointer;
+  slot->next = pool->freeList;
+  pool->freeList = slot;
+  POISON(slot, (size_t)(sizeClass + 1) * POOL_GRANULE);
+}
+
+static void freePools() {
+  while (slabs) {
+    Slab *next = slabs->next;
+    free(slabs);
+    slabs = next;
+  }
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    pools[i].freeList = NULL;
+    pools[i].bump = NULL;
+    pools[i].end = NULL;
+  }
+}
+
 void markValue(Value v) {
   if (IS_OBJ(v)) {
     markObject(AS_OBJ(v));
   }
 }
 
+static void grayObject(Obj *obj) {
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    vm.grayStack =
+        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+    if (!vm.grayStack) {
+      exit(1);
+    }
+  }
+  vm.grayStack[vm.grayCount++] = obj;
+}
+
 void markObject(Obj *obj) {
   if (!obj || obj->isMarked) {
     return;
@@ -50,15 +188,32 @@ void markObject(Obj *obj) {
   printf("\n");
 #endif
   obj->isMarked = true;
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack =
-        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-    if (!vm.grayStack) {
+  grayObject(obj);
+}
+
+void rememberObject(Obj *obj) {
+#ifdef GC_INCREMENTAL
+  // Scan the object again before marking finishes
+  if (vm.gcPhase == GC_MARK && obj->isMarked) {
+    grayObject(obj);
+  }
+#elif defined(GC_GENERATIONAL)
+  if (!obj->isMarked || obj->isRemembered) {
+    return;
+  }
+  obj->isRemembered = true;
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered =
+        (Obj **)realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+    if (!vm.remembered) {
       exit(1);
     }
   }
-  vm.grayStack[vm.grayCount++] = obj;
+  vm.remembered[vm.rememberedCount++] = obj;
+#else
+  (void)obj;
+#endif
 }
 
 static void freeObject(Obj *obj) {
@@ -92,67 +247,97 @@ static void freeObject(Obj *obj) {
     case OBJ_BOUND_METHOD:
       printf("OBJ_BOUND_METHOD\n");
       break;
+    case OBJ_SHAPE:
+      printf("OBJ_SHAPE\n");
+      break;
   }
 #endif
   switch (obj->type) {
   case OBJ_CLASS: {
     ObjClass *clazz = (ObjClass *)obj;
     freeTable(&clazz->methods);
-    FREE(ObjClass, obj);
+    FREE_OBJ(ObjClass, obj);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *func = (ObjFunction *)obj;
     freeChunk(&func->chunk);
-    FREE(ObjFunction, obj);
+    FREE_ARRAY(InlineCache, func->caches, func->cacheCount);
+#ifdef JIT
+    freeNative(func);
+#endif
+    FREE_OBJ(ObjFunction, obj);
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)obj;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, obj);
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+    FREE_OBJ(ObjInstance, obj);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)obj;
+    freeTable(&shape->slots);
+    freeTable(&shape->transitions);
+    FREE_OBJ(ObjShape, obj);
     break;
   }
   case OBJ_NATIVE: {
-    FREE(ObjNative, obj);
+    FREE_OBJ(ObjNative, obj);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)obj;
     FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, obj);
+    FREE_OBJ(ObjClosure, obj);
     break;
   }
   case OBJ_STRING: {
     ObjString *str = (ObjString *)obj;
-    FREE_ARRAY(char, str->chars, str->length + 1);
-    FREE(ObjString, obj);
+    freeBlock(obj, sizeof(ObjString) + str->length + 1);
     break;
   }
   case OBJ_LIST: {
     ObjList *list = (ObjList *)obj;
-    FREE_ARRAY(Value *, list->items, list->count);
-    FREE(ObjList, obj);
+    FREE_ARRAY(Value, list->items, list->capcity);
+    FREE_OBJ(ObjList, obj);
     break;
   }
   case OBJ_UPVALUE:
-    FREE(ObjUpvalue, obj);
+    FREE_OBJ(ObjUpvalue, obj);
     break;
   case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, obj);
+    FREE_OBJ(ObjBoundMethod, obj);
     break;
   }
 }
 
-void freeObjects() {
-  Obj *obj = vm.objects;
+static void freeList(Obj *obj) {
   while (obj) {
     Obj *nxt = obj->next;
     freeObject(obj);
     obj = nxt;
   }
+}
+
+void freeObjects() {
+  freeList(vm.objects);
+#ifdef GC_INCREMENTAL
+  freeList(vm.sweptObjects);
+#endif
+#ifdef GC_GENERATIONAL
+  freeList(vm.youngObjects);
+  free(vm.remembered);
+#endif
 
   free(vm.grayStack);
+  freePools();
+}
+
+static void markArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
 }
 
 static void markRoots() {
@@ -163,19 +348,16 @@ static void markRoots() {
        upvalue = upvalue->next) {
     markObject((Obj *)upvalue);
   }
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalNames);
+  markArray(&vm.globalValues);
 #ifndef VM_ONLY
   markCompilerRoots();
 #endif
+  markPactbRoots();
   markObject((Obj *)vm.initString);
 }
 
-static void markArray(ValueArray *array) {
-  for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i]);
-  }
-}
-
 static void blackenObject(Obj *obj) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *)obj);
@@ -187,6 +369,7 @@ static void blackenObject(Obj *obj) {
     ObjClass *clazz = (ObjClass *)obj;
     markObject((Obj *)clazz->name);
     markTable(&clazz->methods);
+    markObject((Obj *)clazz->shape);
     break;
   }
   case OBJ_CLOSURE: {
@@ -201,12 +384,30 @@ static void blackenObject(Obj *obj) {
     ObjFunction *func = (ObjFunction *)obj;
     markObject((Obj *)func->name);
     markArray(&func->chunk.constants);
+    // Caches hold on to what they resolved so a hit never sees a dead class
+    if (func->caches) {
+      for (int i = 0; i < func->cacheCount; i++) {
+        markObject((Obj *)func->caches[i].shape);
+        markObject((Obj *)func->caches[i].transition);
+        markObject((Obj *)func->caches[i].method);
+      }
+    }
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *inst = (ObjInstance *)obj;
     markObject((Obj *)inst->klass);
-    markTable(&inst->fields);
+    markObject((Obj *)inst->shape);
+    for (int i = 0; i < inst->shape->slotCount; i++) {
+      markValue(inst->fields[i]);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)obj;
+    markObject((Obj *)shape->parent);
+    markTable(&shape->slots);
+    markTable(&shape->transitions);
     break;
   }
   case OBJ_UPVALUE:
@@ -238,12 +439,16 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
+#ifndef GC_INCREMENTAL
+// Frees every unmarked object on list and returns the last one left
+static Obj *sweepList(Obj **list) {
   Obj *prev = NULL;
-  Obj *cur = vm.objects;
+  Obj *cur = *list;
   while (cur) {
     if (cur->isMarked) {
+#ifndef GC_GENERATIONAL
       cur->isMarked = false;
+#endif
       prev = cur;
       cur = cur->next;
     } else {
@@ -252,26 +457,165 @@ static void sweep() {
       if (prev) {
         prev->next = cur;
       } else {
-        vm.objects = cur;
+        *list = cur;
       }
-      free(unreached);
+      freeObject(unreached);
+    }
+  }
+  return prev;
+}
+#endif
+
+#ifdef GC_GENERATIONAL
+// Young objects that survive a collection keep their mark bit, which is what
+// makes them old: later minor collections treat them as reachable without
+// tracing through them.
+static void promoteYoung() {
+  Obj *last = sweepList(&vm.youngObjects);
+  if (last) {
+    last->next = vm.objects;
+    vm.objects = vm.youngObjects;
+  }
+  vm.youngObjects = NULL;
+}
+
+static void forgetRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+}
+
+void collectYoung() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  forgetRemembered();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  promoteYoung();
+  vm.nextYoungGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+#endif
+
+#ifdef GC_INCREMENTAL
+// Roots are not covered by the write barrier, so they are marked once more
+// before the atomic end of the mark phase.
+static void finishMark() {
+  markRoots();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  vm.sweepLink = &vm.objects;
+  vm.gcPhase = GC_SWEEP;
+}
+
+// Returns true once every object from the mark phase has been visited
+static bool sweepStep(int work) {
+  while (work-- > 0 && *vm.sweepLink) {
+    Obj *cur = *vm.sweepLink;
+    if (cur->isMarked) {
+      cur->isMarked = false;
+      vm.sweepLink = &cur->next;
+    } else {
+      *vm.sweepLink = cur->next;
+      freeObject(cur);
+    }
+  }
+  return *vm.sweepLink == NULL;
+}
+
+static void finishSweep() {
+  if (vm.sweptObjects) {
+    vm.sweptTail->next = vm.objects;
+    vm.objects = vm.sweptObjects;
+    vm.sweptObjects = NULL;
+    vm.sweptTail = NULL;
+  }
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.gcPhase = GC_IDLE;
+}
+
+// Does at most GC_STEP_WORK units of marking or sweeping, apart from the
+// root rescan that ends the mark phase.
+void collectStep() {
+  switch (vm.gcPhase) {
+  case GC_IDLE:
+#ifdef DEBUG_LOG_GC
+    printf("-- gc cycle begin\n");
+#endif
+    markRoots();
+    vm.gcPhase = GC_MARK;
+    break;
+  case GC_MARK:
+    for (int work = 0; work < GC_STEP_WORK && vm.grayCount > 0; work++) {
+      blackenObject(vm.grayStack[--vm.grayCount]);
+    }
+    if (vm.grayCount == 0) {
+      finishMark();
     }
+    break;
+  case GC_SWEEP:
+    if (sweepStep(GC_STEP_WORK)) {
+      finishSweep();
+#ifdef DEBUG_LOG_GC
+      printf("-- gc cycle end\n");
+      printf("   %zu bytes in use, next at %zu\n", vm.bytesAllocated,
+             vm.nextGC);
+#endif
+    }
+    break;
   }
 }
 
+void collectGarbage() {
+  if (vm.gcPhase == GC_IDLE) {
+    markRoots();
+    vm.gcPhase = GC_MARK;
+  }
+  if (vm.gcPhase == GC_MARK) {
+    traceReferences();
+    finishMark();
+  }
+  sweepStep(INT32_MAX);
+  finishSweep();
+}
+#else
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   size_t before = vm.bytesAllocated;
+#endif
+#ifdef GC_GENERATIONAL
+  for (Obj *obj = vm.objects; obj; obj = obj->next) {
+    obj->isMarked = false;
+  }
+  forgetRemembered();
 #endif
   markRoots();
   traceReferences();
   tableRemoveWhite(&vm.strings);
-  sweep();
+  sweepList(&vm.objects);
+#ifdef GC_GENERATIONAL
+  promoteYoung();
+#endif
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+#ifdef GC_GENERATIONAL
+  vm.nextYoungGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+#endif
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
          before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
 #endif
 }
+#endif
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -18,11 +19,56 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0);
 
+#define FREE_OBJ(type, pointer) freeBlock(pointer, sizeof(type))
+
 #define GC_HEAP_GROW_FACTOR 2
+// Objects up to POOL_MAX_SIZE bytes come from per-size pools
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_SLAB_SIZE (64 * 1024)
+// Bytes allocated between two minor collections in generational mode
+#define GC_NURSERY_SIZE (1024 * 1024)
+// Objects traced or swept per incremental step, which bounds the pause
+#ifndef GC_STEP_WORK
+#define GC_STEP_WORK 256
+#endif
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *allocateBlock(size_t size);
+void freeBlock(void *pointer, size_t size);
 void collectGarbage();
+#ifdef GC_GENERATIONAL
+void collectYoung();
+#endif
+#ifdef GC_INCREMENTAL
+void collectStep();
+#endif
 void markValue(Value v);
 void markObject(Obj *obj);
 void freeObjects();
+void rememberObject(Obj *obj);
+
+// Must follow every store of a heap reference into an object that may have
+// survived a collection. With the generational collector an old object keeps
+// its mark bit, so storing an unmarked (young) object into one means the
+// next minor collection has to rescan it. With the incremental collector a
+// value stored into an already marked object is marked too, so the mutator
+// can never hide a white object behind a black one.
+#define WRITE_BARRIER(owner, value) writeBarrier((Obj *)(owner), value)
+
+static inline void writeBarrier(Obj *owner, Value value) {
+#ifdef GC_INCREMENTAL
+  if (vm.gcPhase == GC_MARK && owner->isMarked) {
+    markValue(value);
+  }
+#elif defined(GC_GENERATIONAL)
+  if (owner->isMarked && !owner->isRemembered && IS_OBJ(value) &&
+      AS_OBJ(value) != NULL && !AS_OBJ(value)->isMarked) {
+    rememberObject(owner);
+  }
+#else
+  (void)owner;
+  (void)value;
+#endif
+}
 #endif
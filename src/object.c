@@ -11,10 +11,25 @@
 #include "vm.h"
 
 Obj *allocateObject(size_t size, ObjType type) {
-  Obj *obj = (Obj *)reallocate(NULL, 0, size);
+  Obj *obj = (Obj *)allocateBlock(size);
   obj->type = type;
+  obj->isMarked = false;
+  obj->isRemembered = false;
 
+#ifdef GC_GENERATIONAL
+  obj->next = vm.youngObjects;
+#elif defined(GC_INCREMENTAL)
+  if (vm.gcPhase == GC_SWEEP) {
+    obj->next = vm.sweptObjects;
+    if (!vm.sweptTail) {
+      vm.sweptTail = obj;
+    }
+  } else {
+    obj->next = vm.objects;
+  }
+#else
   obj->next = vm.objects;
+#endif
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for ", (void *)obj, size);
@@ -46,10 +61,28 @@ Obj *allocateObject(size_t size, ObjType type) {
     case OBJ_BOUND_METHOD:
       printf("OBJ_BOUND_METHOD\n");
       break;
+    case OBJ_SHAPE:
+      printf("OBJ_SHAPE\n");
+      break;
   }
 #endif
 
+#ifdef GC_GENERATIONAL
+  vm.youngObjects = obj;
+#elif defined(GC_INCREMENTAL)
+  if (vm.gcPhase == GC_SWEEP) {
+    vm.sweptObjects = obj;
+  } else {
+    vm.objects = obj;
+    // Objects allocated while marking start out gray
+    if (vm.gcPhase == GC_MARK) {
+      obj->isMarked = true;
+      rememberObject(obj);
+    }
+  }
+#else
   vm.objects = obj;
+#endif
   return obj;
 }
 
@@ -58,10 +91,30 @@ ObjFunction *newFunction() {
   function->arity = 0;
   function->upvalueCount = 0;
   function->name = NULL;
+  function->cacheCount = 0;
+  function->caches = NULL;
+  function->maxStack = 0;
+  function->record = -1;
+#ifdef JIT
+  function->hotness = 0;
+  function->native = NULL;
+#endif
   initChunk(&function->chunk);
   return function;
 }
 
+void allocateCaches(ObjFunction *function) {
+  InlineCache *caches = ALLOCATE(InlineCache, function->cacheCount);
+  for (int i = 0; i < function->cacheCount; i++) {
+    caches[i].shape = NULL;
+    caches[i].transition = NULL;
+    caches[i].slot = -1;
+    caches[i].version = 0;
+    caches[i].method = NULL;
+  }
+  function->caches = caches;
+}
+
 ObjClosure *newClosure(ObjFunction *function) {
   ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
@@ -95,6 +148,7 @@ void appendToList(ObjList *list, Value value) {
     list->items = GROW_ARRAY(Value, list->items, oldCap, list->capcity);
   }
   list->items[list->count++] = value;
+  WRITE_BARRIER(list, value);
 }
 
 int storeToList(ObjList *list, int index, Value value) {
@@ -103,6 +157,7 @@ int storeToList(ObjList *list, int index, Value value) {
   }
   if (index < list->count && index >= 0) {
     list->items[index] = value;
+    WRITE_BARRIER(list, value);
     return 0;
   } else {
     return 1;
@@ -137,15 +192,14 @@ int deleteFromList(ObjList *list, int idx) {
   }
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Characters live inline after the header; the caller fills them in and
+// then interns the string
+ObjString *allocateString(int length) {
+  ObjString *string = (ObjString *)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  push(OBJ_VAL(string)); // Make sure there is some ref to the string on the
-                         // stack so gc doesnt eat it
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
+  string->hash = 0;
+  string->chars[length] = '\0';
   return string;
 }
 
@@ -158,16 +212,36 @@ uint32_t hashString(const char *key, int length) {
   return hash;
 }
 
+static ObjString *addString(ObjString *string) {
+  push(OBJ_VAL(string)); // Make sure there is some ref to the string on the
+                         // stack so gc doesnt eat it
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
+  return string;
+}
+
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned) {
     return interned;
   }
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  return addString(string);
+}
+
+// Returns the canonical copy of a string built with allocateString. A
+// duplicate is left unreachable for the collector to reclaim.
+ObjString *internString(ObjString *string) {
+  string->hash = hashString(string->chars, string->length);
+  ObjString *interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
+  if (interned) {
+    return interned;
+  }
+  return addString(string);
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -182,16 +256,81 @@ ObjClass *newClass(ObjString *name) {
   ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   class->name = name;
   initTable(&class->methods);
+  class->shape = NULL;
+  class->version = 0;
+  push(OBJ_VAL(class));
+  class->shape = newShape(NULL);
+  WRITE_BARRIER(class, OBJ_VAL(class->shape));
+  pop();
   return class;
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->shape;
+  instance->capacity = 0;
+  instance->fields = NULL;
   return instance;
 }
 
+ObjShape *newShape(ObjShape *parent) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->slotCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  if (parent) {
+    push(OBJ_VAL(shape));
+    tableAddAll(&parent->slots, &shape->slots);
+    rememberObject((Obj *)shape);
+    shape->slotCount = parent->slotCount;
+    pop();
+  }
+  return shape;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+  ObjShape *child = newShape(shape);
+  push(OBJ_VAL(child));
+  tableSet(&child->slots, name, INTEGER_VAL(child->slotCount++));
+  WRITE_BARRIER(child, OBJ_VAL(name));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  WRITE_BARRIER(shape, OBJ_VAL(name));
+  WRITE_BARRIER(shape, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) {
+    return -1;
+  }
+  return (int)AS_INTEGER(slot);
+}
+
+// Moves inst to shape, which must be a direct child of its current shape, and
+// stores value in the new slot.
+void addField(ObjInstance *inst, ObjShape *shape, Value value) {
+  int slot = inst->shape->slotCount;
+  if (inst->capacity <= slot) {
+    int oldCapacity = inst->capacity;
+    Value *fields = GROW_ARRAY(Value, inst->fields, oldCapacity,
+                               GROW_CAPACITY(oldCapacity));
+    inst->fields = fields;
+    inst->capacity = GROW_CAPACITY(oldCapacity);
+  }
+  inst->fields[slot] = value;
+  inst->shape = shape;
+  WRITE_BARRIER(inst, value);
+  WRITE_BARRIER(inst, OBJ_VAL(shape));
+}
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
   bound->receiver = receiver;
@@ -199,16 +338,6 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   return bound;
 }
 
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
-  }
-  return allocateString(chars, length, hash);
-}
-
 static void printFunction(ObjFunction *func) {
   if (func->name == NULL) {
     printf("<script>");
@@ -258,5 +387,8 @@ void printObject(Value value) {
   case OBJ_BOUND_METHOD:
     printFunction(AS_BOUND_METHOD(value)->method->function);
     break;
+  case OBJ_SHAPE:
+    printf("shape");
+    break;
   }
 }
@@ -14,6 +14,7 @@
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
@@ -24,6 +25,7 @@
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 
 typedef enum {
   OBJ_FUNCTION,
@@ -35,19 +37,21 @@ typedef enum {
   OBJ_INSTANCE,
   OBJ_LIST,
   OBJ_BOUND_METHOD,
+  OBJ_SHAPE,
 } ObjType;
 
 struct Obj {
   ObjType type;
   bool isMarked;
+  bool isRemembered;
   struct Obj *next;
 };
 
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
 typedef struct {
@@ -56,6 +60,18 @@ typedef struct {
   int upvalueCount;
   Chunk chunk;
   ObjString *name;
+  int cacheCount;
+  struct InlineCache *caches;
+  // Most values the function has on the stack at once, for sizing the stack
+  // a call reserves
+  int maxStack;
+  // Entry in the loaded program's function table that the body still has to
+  // be read from, or -1 once it has one
+  int record;
+#ifdef JIT
+  uint32_t hotness;
+  struct NativeCode *native;
+#endif
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -72,16 +88,34 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+// The layout of an instance's fields. Adding a field moves an instance to the
+// child shape for that name, so instances that get the same fields in the
+// same order end up sharing one shape. slots maps every field name in the
+// shape to its index in the instance's field array.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent;
+  int slotCount;
+  Table slots;
+  Table transitions;
+} ObjShape;
+
+typedef struct ObjClass {
   Obj obj;
   ObjString *name;
   Table methods;
+  // Every class has its own root shape, so a shape also identifies the class
+  ObjShape *shape;
+  // Bumped whenever the method table changes, invalidating cached methods
+  int version;
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  ObjShape *shape;
+  int capacity;
+  Value *fields;
 } ObjInstance;
 
 typedef struct {
@@ -97,6 +131,18 @@ typedef struct {
   Value *items;
 } ObjList;
 
+// Per-instruction cache for property access and method invocation, valid for
+// instances of shape. A field hit reads slot directly; a set that adds the
+// field also records the transition it took. A method hit additionally needs
+// the class version to match.
+typedef struct InlineCache {
+  ObjShape *shape;
+  ObjShape *transition;
+  int slot;
+  int version;
+  ObjClosure *method;
+} InlineCache;
+
 typedef Value (*NativeFn)(int argc, Value *args);
 
 typedef struct {
@@ -114,7 +160,12 @@ ObjFunction *newFunction();
 ObjNative *newNative(NativeFn function);
 ObjUpvalue *newUpvalue(Value *slot);
 ObjInstance *newInstance(ObjClass *klass);
+ObjShape *newShape(ObjShape *parent);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+void addField(ObjInstance *inst, ObjShape *shape, Value value);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+void allocateCaches(ObjFunction *function);
 
 // List
 ObjList *newList();
@@ -123,7 +174,8 @@ int storeToList(ObjList *list, int index, Value value);
 int indexFromList(ObjList *list, int index, Value *value_str);
 int deleteFromList(ObjList *list, int idx);
 
-ObjString *takeString(char *chars, int length);
+ObjString *allocateString(int length);
+ObjString *internString(ObjString *string);
 ObjString *copyString(const char *chars, int length);
 void printObject(Value value);
 
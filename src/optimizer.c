@@ -0,0 +1,555 @@
+#include "optimizer.h"
+#include "chunk.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_REWRITE 5
+
+// Per-byte facts about the chunk being rewritten. Only entries at the start
+// of an instruction are meaningful.
+typedef struct {
+  int target;    // Destination of a jump, or -1
+  int newOffset; // Where the instruction (or its replacement) ends up
+  bool isStart;
+  bool isTarget;
+  bool isLive;
+  bool isDropped; // Live, but folded into its predecessor or removed
+  int length;     // Length of the rewritten form, or 0 to copy as is
+  uint8_t code[MAX_REWRITE];
+} InstrInfo;
+
+static bool isJump(uint8_t op) {
+  switch (op) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_EQUAL_JUMP:
+  case OP_NOT_EQUAL_JUMP:
+  case OP_GREATER_JUMP:
+  case OP_GREATER_EQUAL_JUMP:
+  case OP_LESS_JUMP:
+  case OP_LESS_EQUAL_JUMP:
+  case OP_LESS_JUMP_LL:
+  case OP_LESS_JUMP_LK:
+  case OP_GREATER_JUMP_LL:
+  case OP_GREATER_JUMP_LK:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Every jump keeps its 16-bit offset in its last two bytes, relative to the
+// end of the instruction
+static int jumpTarget(Chunk *chunk, int offset) {
+  int end = offset + instructionLength(chunk, offset);
+  int jump = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+  if (chunk->code[offset] == OP_LOOP) {
+    return end - jump;
+  }
+  return end + jump;
+}
+
+// Follows a chain of jumps to its final destination. A jump-if-false that
+// lands on another jump-if-false takes that branch too, since the condition
+// is still on the stack. Conditional jumps can only go forwards.
+static int threadJump(Chunk *chunk, InstrInfo *info, int from) {
+  uint8_t op = chunk->code[from];
+  int end = from + instructionLength(chunk, from);
+  int to = info[from].target;
+  for (int hops = 0; hops < chunk->count && to < chunk->count; hops++) {
+    uint8_t next = chunk->code[to];
+    if (next != OP_JUMP && next != OP_LOOP &&
+        !(op == OP_JUMP_IF_FALSE && next == OP_JUMP_IF_FALSE)) {
+      break;
+    }
+    int candidate = info[to].target;
+    if (op != OP_JUMP && op != OP_LOOP && candidate < end) {
+      break;
+    }
+    if (abs(candidate - end) > UINT16_MAX) {
+      break;
+    }
+    to = candidate;
+  }
+  return to;
+}
+
+static void markLive(Chunk *chunk, InstrInfo *info) {
+  int *worklist = malloc(sizeof(int) * chunk->count);
+  int count = 0;
+  worklist[count++] = 0;
+  info[0].isLive = true;
+  while (count > 0) {
+    int offset = worklist[--count];
+    uint8_t op = chunk->code[offset];
+    int successors[2];
+    int successorCount = 0;
+    if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+      successors[successorCount++] = offset + instructionLength(chunk, offset);
+    }
+    if (isJump(op)) {
+      successors[successorCount++] = info[offset].target;
+    }
+    for (int i = 0; i < successorCount; i++) {
+      int next = successors[i];
+      if (next < chunk->count && !info[next].isLive) {
+        info[next].isLive = true;
+        worklist[count++] = next;
+      }
+    }
+  }
+  free(worklist);
+}
+
+static bool isKept(InstrInfo *info, int offset) {
+  return info[offset].isLive && !info[offset].isDropped;
+}
+
+static int nextKept(Chunk *chunk, InstrInfo *info, int offset) {
+  while (offset < chunk->count && !isKept(info, offset)) {
+    offset += instructionLength(chunk, offset);
+  }
+  return offset;
+}
+
+static uint8_t opcodeAt(Chunk *chunk, InstrInfo *info, int offset) {
+  return info[offset].length ? info[offset].code[0] : chunk->code[offset];
+}
+
+// Collects the instruction at offset and up to count - 1 kept instructions
+// after it, stopping early at anything another jump lands on. Returns how
+// many were found.
+static int window(Chunk *chunk, InstrInfo *info, int offset, int *offsets,
+                  int count) {
+  int found = 0;
+  while (found < count && offset < chunk->count) {
+    if (found > 0 && info[offset].isTarget) {
+      break;
+    }
+    offsets[found++] = offset;
+    offset = nextKept(chunk, info, offset + instructionLength(chunk, offset));
+  }
+  return found;
+}
+
+static void rewrite(InstrInfo *info, int offset, int length, uint8_t op,
+                    uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  InstrInfo *instr = &info[offset];
+  instr->length = length;
+  instr->code[0] = op;
+  instr->code[1] = a;
+  instr->code[2] = b;
+  instr->code[3] = c;
+  instr->code[4] = d;
+}
+
+static void drop(InstrInfo *info, int *offsets, int from, int to) {
+  for (int i = from; i < to; i++) {
+    info[offsets[i]].isDropped = true;
+  }
+}
+
+// Merges pairs the compiler emits for a single source operator
+static void fusePairs(Chunk *chunk, InstrInfo *info, int offset) {
+  int seq[2];
+  int found = window(chunk, info, offset, seq, 2);
+  uint8_t op = chunk->code[offset];
+  if (op == OP_JUMP) {
+    if (nextKept(chunk, info, offset + 3) == info[offset].target) {
+      info[offset].isDropped = true;
+    }
+    return;
+  }
+  if (found < 2) {
+    return;
+  }
+  uint8_t next = chunk->code[seq[1]];
+  uint8_t fused;
+  if (op == OP_EQUAL && next == OP_NOT) {
+    fused = OP_NOT_EQUAL;
+  } else if (op == OP_LESS && next == OP_NOT) {
+    fused = OP_GREATER_EQUAL;
+  } else if (op == OP_GREATER && next == OP_NOT) {
+    fused = OP_LESS_EQUAL;
+  } else if (op == OP_SET_LOCAL && next == OP_POP) {
+    rewrite(info, offset, 2, OP_SET_LOCAL_POP, chunk->code[offset + 1], 0, 0,
+            0);
+    drop(info, seq, 1, 2);
+    return;
+  } else {
+    return;
+  }
+  rewrite(info, offset, 1, fused, 0, 0, 0, 0);
+  drop(info, seq, 1, 2);
+}
+
+static uint8_t compareJump(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return OP_EQUAL_JUMP;
+  case OP_NOT_EQUAL:
+    return OP_NOT_EQUAL_JUMP;
+  case OP_GREATER:
+    return OP_GREATER_JUMP;
+  case OP_GREATER_EQUAL:
+    return OP_GREATER_EQUAL_JUMP;
+  case OP_LESS:
+    return OP_LESS_JUMP;
+  case OP_LESS_EQUAL:
+    return OP_LESS_EQUAL_JUMP;
+  default:
+    return 0;
+  }
+}
+
+// Superinstructions for the hottest sequences in test/benchmark, as
+// reported by a DEBUG_OPCODE_STATS build
+static void fuseSequences(Chunk *chunk, InstrInfo *info, int offset) {
+  int seq[4];
+  int found = window(chunk, info, offset, seq, 4);
+  uint8_t ops[4];
+  for (int i = 0; i < found; i++) {
+    ops[i] = opcodeAt(chunk, info, seq[i]);
+  }
+
+  // i = i + k, where k is a number
+  if (found == 4 && ops[0] == OP_GET_LOCAL && ops[1] == OP_CONSTANT &&
+      ops[2] == OP_ADD && ops[3] == OP_SET_LOCAL_POP &&
+      chunk->code[seq[0] + 1] == chunk->code[seq[3] + 1] &&
+      IS_NUMBER(chunk->constants.values[chunk->code[seq[1] + 1]])) {
+    rewrite(info, offset, 3, OP_INCREMENT_LOCAL, chunk->code[seq[0] + 1],
+            chunk->code[seq[1] + 1], 0, 0);
+    drop(info, seq, 1, 4);
+    return;
+  }
+
+  // A comparison that only feeds a branch. Both the POP on the fall-through
+  // path and the one at the branch target get skipped.
+  if (found >= 3 && compareJump(ops[0]) && ops[1] == OP_JUMP_IF_FALSE &&
+      ops[2] == OP_POP && chunk->code[info[seq[1]].target] == OP_POP) {
+    int target = info[seq[1]].target + 1;
+    rewrite(info, offset, 3, compareJump(ops[0]), 0, 0, 0, 0);
+    info[offset].target = target;
+    info[target].isTarget = true;
+    drop(info, seq, 1, 3);
+    return;
+  }
+
+  if (found >= 2 && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_PROPERTY) {
+    uint8_t *property = &chunk->code[seq[1]];
+    rewrite(info, offset, 5, OP_GET_LOCAL_PROPERTY, chunk->code[offset + 1],
+            property[1], property[2], property[3]);
+    drop(info, seq, 1, 2);
+    return;
+  }
+
+  if (found >= 2 && ops[0] == OP_GET_LOCAL && ops[1] == OP_INDEX_SUBSCR) {
+    rewrite(info, offset, 2, OP_GET_LOCAL_INDEX, chunk->code[offset + 1], 0, 0,
+            0);
+    drop(info, seq, 1, 2);
+    return;
+  }
+}
+
+#ifdef REGISTER_OPS
+// Register forms indexed by [operation][L or K]: push, store to a local, and
+// compare-and-branch
+static const uint8_t pushForms[2][2] = {{OP_ADD_LL, OP_ADD_LK},
+                                        {OP_SUBTRACT_LL, OP_SUBTRACT_LK}};
+static const uint8_t storeForms[2][2] = {{OP_ADD_LLL, OP_ADD_LLK},
+                                         {OP_SUBTRACT_LLL, OP_SUBTRACT_LLK}};
+static const uint8_t jumpForms[2][2] = {{OP_LESS_JUMP_LL, OP_LESS_JUMP_LK},
+                                        {OP_GREATER_JUMP_LL,
+                                         OP_GREATER_JUMP_LK}};
+
+// Turns stack sequences whose operands are locals or constants into
+// three-address instructions over frame slots
+static void fuseRegisters(Chunk *chunk, InstrInfo *info, int offset) {
+  int seq[4];
+  int found = window(chunk, info, offset, seq, 4);
+  uint8_t ops[4];
+  for (int i = 0; i < found; i++) {
+    ops[i] = opcodeAt(chunk, info, seq[i]);
+  }
+  if (found < 2 || ops[0] != OP_GET_LOCAL) {
+    return;
+  }
+  uint8_t left = chunk->code[seq[0] + 1];
+
+  if (ops[1] == OP_SET_LOCAL_POP) {
+    rewrite(info, offset, 3, OP_MOVE, chunk->code[seq[1] + 1], left, 0, 0);
+    drop(info, seq, 1, 2);
+    return;
+  }
+  if (found < 3 || (ops[1] != OP_GET_LOCAL && ops[1] != OP_CONSTANT)) {
+    return;
+  }
+  int kind = ops[1] == OP_CONSTANT;
+  uint8_t right = chunk->code[seq[1] + 1];
+
+  int operation = -1;
+  if (ops[2] == OP_ADD || ops[2] == OP_LESS_JUMP) {
+    operation = 0;
+  } else if (ops[2] == OP_SUBTRACT || ops[2] == OP_GREATER_JUMP) {
+    operation = 1;
+  } else {
+    return;
+  }
+  if (ops[2] == OP_LESS_JUMP || ops[2] == OP_GREATER_JUMP) {
+    // The target is already known, so the operand bytes are left as is
+    rewrite(info, offset, 5, jumpForms[operation][kind], left, right, 0, 0);
+    info[offset].target = info[seq[2]].target;
+    drop(info, seq, 1, 3);
+    return;
+  }
+  if (found == 4 && ops[3] == OP_SET_LOCAL_POP) {
+    rewrite(info, offset, 4, storeForms[operation][kind],
+            chunk->code[seq[3] + 1], left, right, 0);
+    drop(info, seq, 1, 4);
+    return;
+  }
+  rewrite(info, offset, 3, pushForms[operation][kind], left, right, 0, 0);
+  drop(info, seq, 1, 3);
+}
+#endif
+
+static int emittedLength(Chunk *chunk, InstrInfo *info, int offset) {
+  return info[offset].length ? info[offset].length
+                             : instructionLength(chunk, offset);
+}
+
+// Threads jump chains, drops unreachable code, merges common instruction
+// sequences into single opcodes and relocates jumps
+static void rewriteChunk(Chunk *chunk) {
+  InstrInfo *info = calloc(chunk->count + 1, sizeof(InstrInfo));
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    info[offset].isStart = true;
+    info[offset].target = -1;
+    if (isJump(chunk->code[offset])) {
+      info[offset].target = jumpTarget(chunk, offset);
+    }
+  }
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (info[offset].isStart && info[offset].target != -1) {
+      info[offset].target = threadJump(chunk, info, offset);
+    }
+  }
+
+  markLive(chunk, info);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (info[offset].isLive && info[offset].target != -1) {
+      info[info[offset].target].isTarget = true;
+    }
+  }
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isKept(info, offset)) {
+      fusePairs(chunk, info, offset);
+    }
+  }
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isKept(info, offset)) {
+      fuseSequences(chunk, info, offset);
+    }
+  }
+#ifdef REGISTER_OPS
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isKept(info, offset)) {
+      fuseRegisters(chunk, info, offset);
+    }
+  }
+#endif
+
+  int newCount = 0;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    info[offset].newOffset = newCount;
+    if (info[offset].isStart && isKept(info, offset)) {
+      newCount += emittedLength(chunk, info, offset);
+    }
+  }
+  info[chunk->count].newOffset = newCount;
+
+  // Instructions only ever move towards the start, but lengths and operands
+  // are read from a copy to keep things simple
+  Chunk old = *chunk;
+  old.code = malloc(chunk->count);
+  old.lines = malloc(sizeof(int) * chunk->count);
+  memcpy(old.code, chunk->code, chunk->count);
+  memcpy(old.lines, chunk->lines, sizeof(int) * chunk->count);
+
+  for (int offset = 0; offset < old.count;
+       offset += instructionLength(&old, offset)) {
+    if (!isKept(info, offset)) {
+      continue;
+    }
+    int to = info[offset].newOffset;
+    int length = emittedLength(&old, info, offset);
+    if (info[offset].length) {
+      memcpy(chunk->code + to, info[offset].code, length);
+    } else {
+      memcpy(chunk->code + to, old.code + offset, length);
+    }
+    for (int i = 0; i < length; i++) {
+      chunk->lines[to + i] = old.lines[offset];
+    }
+    if (info[offset].target != -1) {
+      // The jump operand is always the last two bytes
+      uint8_t *op = &chunk->code[to];
+      int jump = info[info[offset].target].newOffset - (to + length);
+      if (jump < 0) {
+        *op = OP_LOOP;
+        jump = -jump;
+      } else if (*op == OP_LOOP) {
+        *op = OP_JUMP;
+      }
+      chunk->code[to + length - 2] = (jump >> 8) & 0xff;
+      chunk->code[to + length - 1] = jump & 0xff;
+    }
+  }
+  chunk->count = newCount;
+
+  free(old.code);
+  free(old.lines);
+  free(info);
+}
+
+// Change in stack height once the instruction at offset has run. Every jump
+// leaves the same height whether it is taken or not.
+static int stackEffect(Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_GET_UPVALUE_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_ADD_LL:
+  case OP_ADD_LK:
+  case OP_SUBTRACT_LL:
+  case OP_SUBTRACT_LK:
+    return 1;
+  case OP_RETURN:
+  case OP_POP:
+  case OP_SET_LOCAL_POP:
+  case OP_CLOSE_UPVALUE:
+  case OP_PRINT:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER:
+  case OP_GET_SUPER_LONG:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_INDEX_SUBSCR:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_BIT_XOR:
+  case OP_BIT_OR:
+  case OP_BIT_AND:
+  case OP_LSL:
+  case OP_LSR:
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_EQUAL:
+    return -1;
+  case OP_STORE_SUBSCR:
+  case OP_EQUAL_JUMP:
+  case OP_NOT_EQUAL_JUMP:
+  case OP_GREATER_JUMP:
+  case OP_GREATER_EQUAL_JUMP:
+  case OP_LESS_JUMP:
+  case OP_LESS_EQUAL_JUMP:
+    return -2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return -code[2];
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return -code[2] - 1;
+  case OP_BUILD_LIST:
+    return 1 - code[1];
+  default:
+    return 0;
+  }
+}
+
+int maxStackDepth(Chunk *chunk, int entry) {
+  if (chunk->count == 0) {
+    return entry;
+  }
+  // Height before each instruction, or -1 until a path reaches it
+  int *depth = malloc(sizeof(int) * chunk->count);
+  int *worklist = malloc(sizeof(int) * chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    depth[i] = -1;
+  }
+  int count = 0;
+  int max = entry;
+  depth[0] = entry;
+  worklist[count++] = 0;
+  while (count > 0) {
+    int offset = worklist[--count];
+    uint8_t op = chunk->code[offset];
+    int after = depth[offset] + stackEffect(chunk, offset);
+    if (after > max) {
+      max = after;
+    }
+    int successors[2];
+    int successorCount = 0;
+    if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+      successors[successorCount++] = offset + instructionLength(chunk, offset);
+    }
+    if (isJump(op)) {
+      successors[successorCount++] = jumpTarget(chunk, offset);
+    }
+    for (int i = 0; i < successorCount; i++) {
+      int next = successors[i];
+      if (next < chunk->count && depth[next] == -1) {
+        depth[next] = after;
+        worklist[count++] = next;
+      }
+    }
+  }
+  free(worklist);
+  free(depth);
+  return max;
+}
+
+// Fusing a comparison into its branch can leave the POP at the branch target
+// unreachable, so passes repeat until the chunk stops shrinking
+void optimizeChunk(Chunk *chunk) {
+  int count;
+  do {
+    count = chunk->count;
+    if (count > 0) {
+      rewriteChunk(chunk);
+    }
+  } while (chunk->count < count);
+}
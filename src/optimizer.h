@@ -0,0 +1,11 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk *chunk);
+// Most values a call of the finished chunk has on the stack at once, counting
+// the entry values in its frame: the callee and its arguments
+int maxStackDepth(Chunk *chunk, int entry);
+
+#endif
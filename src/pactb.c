@@ -0,0 +1,639 @@
+#include "pactb.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+uint64_t hashSource(const char *src) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037u;
+  for (const char *c = src; *c; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+// Changes whenever OPCODE_LIST does, without anyone having to remember to
+// bump PACTB_VERSION
+static uint64_t opcodeHash() {
+#define OPCODE_NAME(name) #name " "
+  return hashSource(OPCODE_LIST(OPCODE_NAME));
+#undef OPCODE_NAME
+}
+
+char *pactbPath(const char *script) {
+  const char *slash = strrchr(script, '/');
+  const char *dot = strrchr(slash ? slash + 1 : script, '.');
+  size_t nameLength = dot ? (size_t)(dot - script) : strlen(script);
+  char *path = malloc(nameLength + sizeof(".pactb"));
+  if (!path) {
+    return NULL;
+  }
+  memcpy(path, script, nameLength);
+  memcpy(path + nameLength, ".pactb", sizeof(".pactb"));
+  return path;
+}
+
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t capacity;
+} Bytecode;
+
+// Records go to bytes; code and line arrays go to the code section
+static Bytecode bytes;
+static Bytecode section;
+// The function table is built separately because its count comes first
+static Bytecode functions;
+static int functionCount;
+// Maps each string to its index in the string table
+static Table stringIndex;
+static ValueArray strings;
+
+static void initBuffer(Bytecode *buffer) {
+  buffer->capacity = 16;
+  buffer->buf = malloc(sizeof(uint8_t) * 16);
+  buffer->size = 0;
+}
+
+static void appendBuffer(Bytecode *buffer, const void *ptr, size_t size,
+                         size_t nelem) {
+  size_t req = size * nelem;
+  if (buffer->size + req >= buffer->capacity) {
+    size_t newCapacity = buffer->capacity * 2;
+    if (newCapacity < buffer->size + req) {
+      newCapacity = buffer->capacity + req;
+    }
+    buffer->buf = realloc(buffer->buf, newCapacity);
+    buffer->capacity = newCapacity;
+  }
+  memcpy(buffer->buf + buffer->size, ptr, req);
+  buffer->size += req;
+}
+
+static void appendVarint(Bytecode *buffer, uint64_t value) {
+  uint8_t encoded[VARINT_MAX];
+  appendBuffer(buffer, encoded, 1, encodeVarint(value, encoded));
+}
+
+// Appends an array to the code section and returns its offset there
+static int64_t writeSection(const void *ptr, size_t size, size_t nelem) {
+  static const uint8_t padding[PACTB_ALIGN] = {0};
+  appendBuffer(&section, padding, 1, -section.size & (PACTB_ALIGN - 1));
+  int64_t offset = (int64_t)section.size;
+  appendBuffer(&section, ptr, size, nelem);
+  return offset;
+}
+
+static void freeBuffer(Bytecode *buffer) { free(buffer->buf); }
+
+static int stringIndexOf(ObjString *str) {
+  Value index;
+  if (tableGet(&stringIndex, str, &index)) {
+    return (int)AS_INTEGER(index);
+  }
+  tableSet(&stringIndex, str, INTEGER_VAL(strings.count));
+  writeValueArray(&strings, OBJ_VAL(str));
+  return strings.count - 1;
+}
+
+// Gives every string the program uses a place in the string table
+static void collectStrings(ObjFunction *f) {
+  if (f->name) {
+    stringIndexOf(f->name);
+  }
+  for (int i = 0; i < f->chunk.constants.count; i++) {
+    Value v = f->chunk.constants.values[i];
+    if (IS_STRING(v)) {
+      stringIndexOf(AS_STRING(v));
+    } else if (IS_FUNCTION(v)) {
+      collectStrings(AS_FUNCTION(v));
+    }
+  }
+}
+
+// Fails for values a .pactb has no tag for
+static bool writeValue(Bytecode *out, Value v) {
+  switch (VALUE_TYPE(v)) {
+  case VAL_BOOL:
+    appendVarint(out, AS_BOOL(v) ? PACTB_TRUE : PACTB_FALSE);
+    break;
+  case VAL_NIL:
+    appendVarint(out, PACTB_NIL);
+    break;
+  case VAL_CHARACTER: {
+    uint8_t tmp = (uint8_t)AS_CHARACTER(v);
+    appendVarint(out, PACTB_CHARACTER);
+    appendBuffer(out, &tmp, sizeof(uint8_t), 1);
+    break;
+  }
+  case VAL_INTEGER:
+    appendVarint(out, PACTB_INTEGER);
+    appendVarint(out, zigzagEncode(AS_INTEGER(v)));
+    break;
+  case VAL_FLOAT: {
+    double tmp = AS_FLOATING(v);
+    appendVarint(out, PACTB_FLOAT);
+    appendBuffer(out, &tmp, sizeof(double), 1);
+    break;
+  }
+  case VAL_OBJ:
+    if (!IS_STRING(v)) {
+      return false;
+    }
+    appendVarint(out, PACTB_STRING);
+    appendVarint(out, stringIndexOf(AS_STRING(v)));
+    break;
+  }
+  return true;
+}
+
+// Adds f to the function table after the functions nested in it, and sets
+// index to its index there. Fails if a constant can't be written.
+static bool writeFunction(ObjFunction *f, bool lines, int *index) {
+  int *nested = malloc(sizeof(int) * (f->chunk.constants.count + 1));
+  if (!nested) {
+    return false;
+  }
+  for (int i = 0; i < f->chunk.constants.count; i++) {
+    Value v = f->chunk.constants.values[i];
+    nested[i] = -1;
+    if (IS_FUNCTION(v) && !writeFunction(AS_FUNCTION(v), lines, &nested[i])) {
+      free(nested);
+      return false;
+    }
+  }
+  int lineInfoSize = lines ? f->chunk.lineInfoSize : 0;
+
+  Bytecode record;
+  initBuffer(&record);
+  appendVarint(&record, f->arity);
+  appendVarint(&record, f->upvalueCount);
+  appendVarint(&record, f->cacheCount);
+  appendVarint(&record, f->maxStack);
+  appendVarint(&record, f->name ? stringIndexOf(f->name) + 1 : 0);
+  appendVarint(&record, f->chunk.count);
+  appendVarint(&record,
+               writeSection(f->chunk.code, sizeof(uint8_t), f->chunk.count));
+  appendVarint(&record, lineInfoSize);
+  appendVarint(&record, writeSection(f->chunk.lineInfo, sizeof(uint8_t),
+                                     lineInfoSize));
+  appendVarint(&record, f->chunk.constants.count);
+  bool ok = true;
+  for (int i = 0; i < f->chunk.constants.count && ok; i++) {
+    if (nested[i] >= 0) {
+      appendVarint(&record, PACTB_FUNCTION);
+      appendVarint(&record, nested[i]);
+    } else {
+      ok = writeValue(&record, f->chunk.constants.values[i]);
+    }
+  }
+  free(nested);
+  if (!ok) {
+    freeBuffer(&record);
+    return false;
+  }
+
+  appendVarint(&functions, record.size);
+  appendBuffer(&functions, record.buf, sizeof(uint8_t), record.size);
+  freeBuffer(&record);
+  *index = functionCount++;
+  return true;
+}
+
+bool writePactb(const char *path, ObjFunction *script, uint64_t sourceHash,
+                bool lines) {
+  // The file is written beside its final name and renamed into place, so a
+  // reader never sees half of one
+  char *tmpPath = malloc(strlen(path) + 32);
+  if (!tmpPath) {
+    return false;
+  }
+  sprintf(tmpPath, "%s.%ld.tmp", path, (long)getpid());
+  FILE *file = fopen(tmpPath, "wb");
+  if (!file) {
+    free(tmpPath);
+    return false;
+  }
+
+  // Keeps the program alive while the string index allocates
+  push(OBJ_VAL(script));
+  initBuffer(&bytes);
+  initBuffer(&section);
+  initBuffer(&functions);
+  functionCount = 0;
+  initTable(&stringIndex);
+  initValueArray(&strings);
+
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    stringIndexOf(AS_STRING(vm.globalNames.values[i]));
+  }
+  collectStrings(script);
+  int top;
+  bool ok = writeFunction(script, lines, &top);
+
+  appendVarint(&bytes, strings.count);
+  for (int i = 0; i < strings.count; i++) {
+    ObjString *str = AS_STRING(strings.values[i]);
+    appendVarint(&bytes, str->length);
+    appendBuffer(&bytes, str->chars, sizeof(char), str->length);
+  }
+  // Global slots are resolved at compile time, so the VM needs the names in
+  // slot order to rebuild the same layout
+  appendVarint(&bytes, vm.globalNames.count);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    appendVarint(&bytes, stringIndexOf(AS_STRING(vm.globalNames.values[i])));
+  }
+  appendVarint(&bytes, functionCount);
+  appendBuffer(&bytes, functions.buf, sizeof(uint8_t), functions.size);
+
+  PactbHeader header;
+  memset(&header, 0, sizeof(PactbHeader));
+  memcpy(header.magic, PACTB_MAGIC, sizeof(header.magic));
+  header.version = PACTB_VERSION;
+  header.build = PACTB_BUILD;
+  header.sourceHash = sourceHash;
+  header.opcodes = opcodeHash();
+  header.codeSection =
+      (sizeof(PactbHeader) + bytes.size + PACTB_PAGE - 1) & -PACTB_PAGE;
+  // A program that couldn't be written leaves the file empty, and it is
+  // removed instead of being renamed into place
+  if (ok) {
+    fwrite(&header, sizeof(PactbHeader), 1, file);
+    fwrite(bytes.buf, sizeof(uint8_t), bytes.size, file);
+    fseek(file, header.codeSection, SEEK_SET);
+    fwrite(section.buf, sizeof(uint8_t), section.size, file);
+    ok = !ferror(file);
+  }
+  ok = fclose(file) == 0 && ok;
+  ok = ok && rename(tmpPath, path) == 0;
+  if (!ok) {
+    remove(tmpPath);
+  }
+  free(tmpPath);
+
+  freeBuffer(&bytes);
+  freeBuffer(&section);
+  freeBuffer(&functions);
+  freeTable(&stringIndex);
+  freeValueArray(&strings);
+  pop();
+  return ok;
+}
+
+// The program is mapped rather than read. The mapping is private and
+// writable because quickening patches opcodes in place; only the pages that
+// get patched are copied.
+typedef struct {
+  uint8_t *base;
+  size_t size;
+  size_t pos;
+  size_t section;
+  // Where each entry of the string and function tables starts, at its length
+  int stringCount;
+  size_t *strings;
+  // Each string once something has referred to it, NULL until then
+  ObjString **interned;
+  int functionCount;
+  size_t *functions;
+} Mapping;
+
+static Mapping program;
+
+// Reads a varint from the records, failing if it runs past end
+static bool readVarint(Mapping *file, size_t end, uint64_t *value) {
+  int length = decodeVarint(file->base + file->pos, file->base + end, value);
+  file->pos += length;
+  return length > 0;
+}
+
+// Reads a varint that must be below limit
+static bool readCount(Mapping *file, size_t end, uint64_t limit, int *value) {
+  uint64_t tmp;
+  if (!readVarint(file, end, &tmp) || tmp >= limit) {
+    return false;
+  }
+  *value = (int)tmp;
+  return true;
+}
+
+// Points into the code section, or NULL if the array is not inside it
+static void *sectionArray(Mapping *file, uint64_t offset, size_t size) {
+  if (offset % PACTB_ALIGN != 0 || offset > file->size - file->section ||
+      size > file->size - file->section - offset) {
+    return NULL;
+  }
+  return file->base + file->section + offset;
+}
+
+// Steps over the length of a table entry and returns where the entry ends.
+// Entries were checked to fit in the records when the tables were indexed.
+static size_t enterEntry(Mapping *file, size_t entry) {
+  uint64_t length;
+  file->pos = entry;
+  readVarint(file, file->section, &length);
+  return file->pos + length;
+}
+
+// Strings are interned when something first refers to them, and only then
+static ObjString *stringAt(Mapping *file, int index) {
+  if (file->interned[index]) {
+    return file->interned[index];
+  }
+  size_t pos = file->pos;
+  size_t end = enterEntry(file, file->strings[index]);
+  file->interned[index] =
+      copyString((char *)file->base + file->pos, end - file->pos);
+  file->pos = pos;
+  return file->interned[index];
+}
+
+static bool readString(Mapping *file, size_t end, ObjString **string) {
+  int index;
+  if (!readCount(file, end, file->stringCount, &index)) {
+    return false;
+  }
+  *string = stringAt(file, index);
+  return true;
+}
+
+// Stands in for a nested function until a closure is made from it. Only the
+// arity and upvalue count are read now, since instructionLength needs the
+// latter to step over OP_CLOSURE.
+static ObjFunction *newStub(Mapping *file, int index) {
+  size_t pos = file->pos;
+  size_t end = enterEntry(file, file->functions[index]);
+  int arity, upvalueCount;
+  bool ok = readCount(file, end, UINT8_COUNT, &arity) &&
+            readCount(file, end, UINT16_COUNT, &upvalueCount);
+  file->pos = pos;
+  if (!ok) {
+    return NULL;
+  }
+  ObjFunction *stub = newFunction();
+  stub->arity = arity;
+  stub->upvalueCount = upvalueCount;
+  stub->record = index;
+  return stub;
+}
+
+static bool readValue(Mapping *file, size_t end, int record, Value *value) {
+  uint64_t tag;
+  if (!readVarint(file, end, &tag)) {
+    return false;
+  }
+  switch (tag) {
+  case PACTB_NIL:
+    *value = NIL_VAL;
+    return true;
+  case PACTB_FALSE:
+    *value = BOOL_VAL(false);
+    return true;
+  case PACTB_TRUE:
+    *value = BOOL_VAL(true);
+    return true;
+  case PACTB_CHARACTER:
+    if (file->pos >= end) {
+      return false;
+    }
+    *value = CHAR_VAL(file->base[file->pos++]);
+    return true;
+  case PACTB_INTEGER: {
+    uint64_t tmp;
+    if (!readVarint(file, end, &tmp) || !INTEGER_FITS(zigzagDecode(tmp))) {
+      return false;
+    }
+    *value = INTEGER_VAL(zigzagDecode(tmp));
+    return true;
+  }
+  case PACTB_FLOAT: {
+    double tmp;
+    if (end - file->pos < sizeof(double)) {
+      return false;
+    }
+    memcpy(&tmp, file->base + file->pos, sizeof(double));
+    file->pos += sizeof(double);
+    *value = FLOAT_VAL(tmp);
+    return true;
+  }
+  case PACTB_STRING: {
+    ObjString *string;
+    if (!readString(file, end, &string)) {
+      return false;
+    }
+    *value = OBJ_VAL(string);
+    return true;
+  }
+  case PACTB_FUNCTION: {
+    // Nested functions come earlier in the table, which rules out cycles
+    int index;
+    ObjFunction *stub;
+    if (!readCount(file, end, record, &index) ||
+        !(stub = newStub(file, index))) {
+      return false;
+    }
+    *value = OBJ_VAL(stub);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Fills in f from its entry in the function table
+static bool readFunction(Mapping *file, ObjFunction *f, int record) {
+  size_t end = enterEntry(file, file->functions[record]);
+  int arity, upvalueCount, cacheCount, maxStack, name, count, lineInfoSize,
+      constantCount;
+  uint64_t code, lines;
+  if (!readCount(file, end, UINT8_COUNT, &arity) ||
+      !readCount(file, end, UINT16_COUNT, &upvalueCount) ||
+      !readCount(file, end, INT32_MAX, &cacheCount) ||
+      !readCount(file, end, STACK_MAX, &maxStack) ||
+      !readCount(file, end, (uint64_t)file->stringCount + 1, &name) ||
+      !readCount(file, end, INT32_MAX, &count) ||
+      !readVarint(file, end, &code) ||
+      !readCount(file, end, INT32_MAX, &lineInfoSize) ||
+      !readVarint(file, end, &lines) ||
+      !readCount(file, end, UINT16_COUNT, &constantCount) ||
+      cacheCount > count) {
+    return false;
+  }
+  // The chunk borrows its arrays from the mapping, which its zero capacity
+  // tells freeChunk
+  uint8_t *codeArray = sectionArray(file, code, sizeof(uint8_t) * count);
+  uint8_t *lineInfo = sectionArray(file, lines, lineInfoSize);
+  if (!codeArray || !lineInfo) {
+    return false;
+  }
+  f->arity = arity;
+  f->upvalueCount = upvalueCount;
+  f->maxStack = maxStack;
+  f->cacheCount = cacheCount;
+  allocateCaches(f);
+  f->chunk.code = codeArray;
+  f->chunk.lineInfo = lineInfoSize > 0 ? lineInfo : NULL;
+  f->chunk.lineInfoSize = lineInfoSize;
+  f->chunk.count = count;
+
+  for (int i = 0; i < constantCount; i++) {
+    Value value;
+    if (!readValue(file, end, record, &value)) {
+      return false;
+    }
+    addConstant(&f->chunk, value);
+    WRITE_BARRIER(f, value);
+  }
+  if (name > 0) {
+    f->name = stringAt(file, name - 1);
+    WRITE_BARRIER(f, OBJ_VAL(f->name));
+  }
+  if (file->pos != end) {
+    return false;
+  }
+  f->record = -1;
+#ifdef NO_LAZY_LOAD
+  for (int i = 0; i < constantCount; i++) {
+    Value value = f->chunk.constants.values[i];
+    if (IS_FUNCTION(value) && !loadFunction(AS_FUNCTION(value))) {
+      return false;
+    }
+  }
+#endif
+  return true;
+}
+
+bool loadFunction(ObjFunction *function) {
+  return readFunction(&program, function, function->record);
+}
+
+// Records where each entry of a table starts and checks that it fits
+static bool indexTable(Mapping *file, int *count, size_t **entries) {
+  size_t end = file->section;
+  uint64_t tmp;
+  // Every entry takes at least the byte holding its length
+  if (!readVarint(file, end, &tmp) || tmp >= INT32_MAX ||
+      tmp > end - file->pos) {
+    return false;
+  }
+  *count = (int)tmp;
+  *entries = malloc(sizeof(size_t) * (*count + 1));
+  if (!*entries) {
+    return false;
+  }
+  for (int i = 0; i < *count; i++) {
+    (*entries)[i] = file->pos;
+    uint64_t length;
+    if (!readVarint(file, end, &length) || length > end - file->pos) {
+      return false;
+    }
+    file->pos += length;
+  }
+  return true;
+}
+
+static ObjFunction *readProgram(Mapping *file, const uint64_t *sourceHash) {
+  PactbHeader header;
+  memcpy(&header, file->base, sizeof(PactbHeader));
+  if (memcmp(header.magic, PACTB_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != PACTB_VERSION || header.build != PACTB_BUILD ||
+      header.opcodes != opcodeHash() ||
+      (sourceHash && header.sourceHash != *sourceHash)) {
+    return NULL;
+  }
+  if (header.codeSection < (int64_t)sizeof(PactbHeader) ||
+      (uint64_t)header.codeSection > file->size) {
+    return NULL;
+  }
+  file->section = header.codeSection;
+  file->pos = sizeof(PactbHeader);
+
+  if (!indexTable(file, &file->stringCount, &file->strings)) {
+    return NULL;
+  }
+  file->interned = calloc(file->stringCount + 1, sizeof(ObjString *));
+  if (!file->interned) {
+    return NULL;
+  }
+  int globalCount;
+  if (!readCount(file, file->section, INT32_MAX, &globalCount)) {
+    return NULL;
+  }
+  for (int i = 0; i < globalCount; i++) {
+    ObjString *name;
+    if (!readString(file, file->section, &name) || globalSlot(name) != i) {
+      return NULL;
+    }
+  }
+  if (!indexTable(file, &file->functionCount, &file->functions) ||
+      file->functionCount == 0) {
+    return NULL;
+  }
+
+  // The top level function comes last
+  ObjFunction *script = newFunction();
+  push(OBJ_VAL(script));
+  bool ok = readFunction(file, script, file->functionCount - 1);
+  pop();
+  return ok ? script : NULL;
+}
+
+ObjFunction *loadPactb(const char *path, const uint64_t *sourceHash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PactbHeader)) {
+    close(fd);
+    return NULL;
+  }
+  Mapping *file = &program;
+  file->size = st.st_size;
+  file->base =
+      mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file->base == MAP_FAILED) {
+    file->base = NULL;
+    return NULL;
+  }
+
+  ObjFunction *script = readProgram(file, sourceHash);
+  if (!script) {
+    unloadPactb();
+  }
+  return script;
+}
+
+void unloadPactb() {
+  if (program.base) {
+    munmap(program.base, program.size);
+  }
+  free(program.strings);
+  free(program.interned);
+  free(program.functions);
+  memset(&program, 0, sizeof(Mapping));
+}
+
+// Interned strings stay alive while the program is loaded, so each is only
+// ever hashed and interned once
+void markPactbRoots() {
+  if (!program.interned) {
+    return;
+  }
+  for (int i = 0; i < program.stringCount; i++) {
+    markObject((Obj *)program.interned[i]);
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef clox_pactb_h
+#define clox_pactb_h
+
+#include "object.h"
+#include "varint.h"
+#include <stdint.h>
+
+// A .pactb file is a header, then the records, then the code section.
+//
+// The records are varint-encoded. First comes the string table. Everything
+// else names strings by their index in it, so each is stored and interned
+// once. Next are the global names in slot order, then the function table.
+// Functions come after the functions nested in them, which leaves the
+// top-level function last. Each entry is prefixed with its length, so a
+// reader can step over it.
+//
+// Function records refer to their code and packed line table by offset into
+// the code section instead of carrying them inline. The section starts on a
+// page boundary, and each array in it is aligned, so the loader can map the
+// file and point chunks at the arrays directly. A line table may be empty,
+// for a program written without line info.
+#define PACTB_MAGIC "PACT"
+// Files also record a hash of the opcode names, which catches opcodes being
+// added, removed or reordered. Bump this for any other change to what a file
+// means: its layout, or what an existing opcode or operand does.
+#define PACTB_VERSION 6
+#define PACTB_PAGE 4096
+#define PACTB_ALIGN 8
+
+// Build options that change what the compiler emits: the instructions, and
+// integer constants, which NaN boxing narrows
+#ifdef REGISTER_OPS
+#define PACTB_REGISTER_OPS 1
+#else
+#define PACTB_REGISTER_OPS 0
+#endif
+#ifdef NAN_BOXING
+#define PACTB_NAN_BOXING 2
+#else
+#define PACTB_NAN_BOXING 0
+#endif
+#define PACTB_BUILD (PACTB_REGISTER_OPS | PACTB_NAN_BOXING)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t build;
+  uint64_t sourceHash; // hashSource of the script it was compiled from
+  uint64_t opcodes;    // opcodeHash of the instruction set it targets
+  int64_t codeSection; // File offset of the code section
+} PactbHeader;
+
+// Tags for constants in a function record
+typedef enum {
+  PACTB_NIL,
+  PACTB_FALSE,
+  PACTB_TRUE,
+  PACTB_CHARACTER, // One byte
+  PACTB_INTEGER,   // Zigzag varint
+  PACTB_FLOAT,     // Eight bytes
+  PACTB_STRING,    // Varint index into the string table
+  PACTB_FUNCTION,  // Varint index of an earlier function
+} PactbConstant;
+
+uint64_t hashSource(const char *src);
+// Where the .pactb for a script goes: the script's path with its extension
+// replaced. The caller frees it. NULL if there is no memory for it.
+char *pactbPath(const char *script);
+// Writes script and the global layout to path, replacing any file there.
+// Without lines, runtime errors can't say where they happened.
+bool writePactb(const char *path, ObjFunction *script, uint64_t sourceHash,
+                bool lines);
+// Maps the program at path, or returns NULL if it is not a valid .pactb for
+// this build. With sourceHash, the file must also have been compiled from
+// that source. The mapping must outlive the VM.
+ObjFunction *loadPactb(const char *path, const uint64_t *sourceHash);
+void unloadPactb();
+void markPactbRoots();
+// Nested functions are left as stubs until a closure is first made from one,
+// unless the VM is built with NO_LAZY_LOAD. Reads the body of such a stub.
+bool loadFunction(ObjFunction *function);
+
+#endif
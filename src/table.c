@@ -130,7 +130,7 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
 }
 
 void tableRemoveWhite(Table *table) {
-  for (int i = 0; i > table->capacity; i++) {
+  for (int i = 0; i < table->capacity; i++) {
     Entry *e = &table->entries[i];
     if (e->key && !e->key->obj.isMarked) {
       tableDelete(table, e->key);
@@ -27,7 +27,7 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
     break;
@@ -50,6 +50,12 @@ void printValue(Value value) {
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  if (IS_FLOATING(a) && IS_FLOATING(b)) {
+    return AS_FLOATING(a) == AS_FLOATING(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
   switch (a.type) {
@@ -57,6 +63,8 @@ bool valuesEqual(Value a, Value b) {
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
     return true;
+  case VAL_CHARACTER:
+    return AS_CHARACTER(a) == AS_CHARACTER(b);
   case VAL_INTEGER:
     return AS_INTEGER(a) == AS_INTEGER(b);
   case VAL_FLOAT:
@@ -66,4 +74,5 @@ bool valuesEqual(Value a, Value b) {
   default:
     return false;
   }
+#endif
 }
@@ -1,6 +1,9 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <limits.h>
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -15,6 +18,87 @@ typedef enum {
   VAL_OBJ,
 } ValueType;
 
+#ifdef NAN_BOXING
+
+// Every non-float value lives in the payload of a quiet NaN. Objects set the
+// sign bit and keep their 48-bit pointer in the low bits, everything else uses
+// bits 48-49 to say what the low bits hold. Integers only get the low 48 bits,
+// so anything outside INTEGER_MIN..INTEGER_MAX is an error rather than cut.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_CHARACTER ((uint64_t)1 << 48)
+#define TAG_INTEGER ((uint64_t)2 << 48)
+#define TAG_MASK ((uint64_t)3 << 48)
+#define PAYLOAD_MASK ((uint64_t)0x0000ffffffffffff)
+
+#define INTEGER_MIN (-((long)1 << 47))
+#define INTEGER_MAX (((long)1 << 47) - 1)
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define CHAR_VAL(c) ((Value)(QNAN | TAG_CHARACTER | (uint8_t)(c)))
+#define INTEGER_VAL(i)                                                         \
+  ((Value)(QNAN | TAG_INTEGER | ((uint64_t)(i)&PAYLOAD_MASK)))
+#define FLOAT_VAL(num) floatToValue(num)
+#define OBJ_VAL(obj) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INTEGER(value) ((long)((int64_t)((value) << 16) >> 16))
+#define AS_FLOATING(value) valueToFloat(value)
+#define AS_CHARACTER(value) ((char)((value)&0xff))
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_CHARACTER(value)                                                    \
+  (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_CHARACTER))
+#define IS_INTEGER(value)                                                      \
+  (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_INTEGER))
+#define IS_FLOATING(value) (((value)&QNAN) != QNAN)
+#define IS_NUMBER(value) (IS_INTEGER(value) || IS_FLOATING(value))
+#define IS_OBJ(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+
+#define VALUE_TYPE(value) valueType(value)
+
+static inline double valueToFloat(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value floatToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+static inline ValueType valueType(Value value) {
+  if (IS_FLOATING(value)) {
+    return VAL_FLOAT;
+  }
+  if (IS_OBJ(value)) {
+    return VAL_OBJ;
+  }
+  if (IS_INTEGER(value)) {
+    return VAL_INTEGER;
+  }
+  if (IS_CHARACTER(value)) {
+    return VAL_CHARACTER;
+  }
+  return IS_NIL(value) ? VAL_NIL : VAL_BOOL;
+}
+
+#else
+
 typedef struct {
   ValueType type;
   union {
@@ -47,6 +131,64 @@ typedef struct {
 #define IS_FLOATING(value) ((value).type == VAL_FLOAT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#define VALUE_TYPE(value) ((value).type)
+
+#define INTEGER_MIN LONG_MIN
+#define INTEGER_MAX LONG_MAX
+
+#endif
+
+#define INTEGER_FITS(i) ((i) >= INTEGER_MIN && (i) <= INTEGER_MAX)
+
+// Integer arithmetic shared by the VM and the constant folder. op is the
+// operator's first character, so '<' and '>' are the shifts. Results wrap at
+// 64 bits; false means the result is outside INTEGER_MIN..INTEGER_MAX, which
+// only a NaN-boxed build can see. Division and shifts by an out of range
+// count are left to the caller.
+static inline bool integerArithmetic(char op, long a, long b, long *result) {
+  unsigned long x = (unsigned long)a;
+  unsigned long y = (unsigned long)b;
+  switch (op) {
+  case '+':
+    *result = (long)(x + y);
+    break;
+  case '-':
+    *result = (long)(x - y);
+    break;
+  case '*':
+    *result = (long)(x * y);
+    // A product can wrap past 64 bits and land back in range
+    if (INTEGER_MAX < LONG_MAX && a != 0 && *result / a != b) {
+      return false;
+    }
+    break;
+  case '/':
+    *result = a / b;
+    break;
+  case '&':
+    *result = a & b;
+    break;
+  case '|':
+    *result = a | b;
+    break;
+  case '^':
+    *result = a ^ b;
+    break;
+  case '<':
+    *result = (long)(x << b);
+    if (INTEGER_MAX < LONG_MAX && (b < 0 || b >= 64 || *result >> b != a)) {
+      return false;
+    }
+    break;
+  case '>':
+    *result = a >> b;
+    break;
+  default:
+    return false;
+  }
+  return INTEGER_FITS(*result);
+}
+
 typedef struct {
   int capacity;
   int count;
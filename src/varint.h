@@ -0,0 +1,44 @@
+#ifndef clox_varint_h
+#define clox_varint_h
+
+#include <stdint.h>
+
+// Longest encoding of a 64-bit varint
+#define VARINT_MAX 10
+
+// Writes value to out as a little-endian base-128 varint and returns how many
+// bytes it took
+static inline int encodeVarint(uint64_t value, uint8_t *out) {
+  int length = 0;
+  while (value >= 0x80) {
+    out[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+  return length;
+}
+
+// Reads a varint that ends before end and returns how many bytes it took, or
+// 0 if it is cut off or too long
+static inline int decodeVarint(const uint8_t *in, const uint8_t *end,
+                               uint64_t *value) {
+  *value = 0;
+  for (int i = 0; i < VARINT_MAX && in + i < end; i++) {
+    *value |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Zigzag folds signed integers so small magnitudes of either sign encode short
+static inline uint64_t zigzagEncode(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzagDecode(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif
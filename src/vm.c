@@ -8,8 +8,10 @@
 #include <unistd.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "pactb.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -22,7 +24,13 @@ VM vm;
 
 static Value peek(int distance);
 static bool callValue(Value callee, int argCount);
-static bool invoke(ObjString *name, int argCount);
+static bool invoke(ObjString *name, int argCount, InlineCache *cache);
+static ObjClosure *lookupMethod(ObjInstance *inst, ObjString *name,
+                                InlineCache *cache);
+static bool getProperty(ObjInstance *inst, ObjString *name,
+                        InlineCache *cache);
+static void setProperty(ObjInstance *inst, ObjString *name, Value value,
+                        InlineCache *cache);
 static bool invokeFromClass(ObjClass *clazz, ObjString *name, int argCount);
 static bool bindMethod(ObjClass *clazz, ObjString *name);
 static ObjUpvalue *captureUpvalue(Value *local);
@@ -30,6 +38,7 @@ static void defineMethod(ObjString *name);
 static bool isFalsey(Value val);
 static void concatenateStrings();
 static void concatenateLists();
+static bool addObjects();
 static void closeUpvalues(Value *last);
 
 static void resetStack() {
@@ -38,6 +47,8 @@ static void resetStack() {
   vm.openUpvalues = NULL;
 }
 
+#define TRACE_FRAMES 8
+
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -46,10 +57,18 @@ static void runtimeError(const char *format, ...) {
 
   fputs("\n", stderr);
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    // A deep stack only shows the innermost and outermost few frames
+    if (vm.frameCount > 2 * TRACE_FRAMES &&
+        i == vm.frameCount - 1 - TRACE_FRAMES) {
+      fprintf(stderr, "... %d more\n", vm.frameCount - 2 * TRACE_FRAMES);
+      i = TRACE_FRAMES;
+      continue;
+    }
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ",
+            getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -60,7 +79,7 @@ static void runtimeError(const char *format, ...) {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
   ObjFunction *function = frame->closure->function;
   size_t instr = frame->ip - function->chunk.code - 1;
-  int line = function->chunk.lines[instr];
+  int line = getLine(&function->chunk, (int)instr);
 
   fprintf(stderr, "[line %d] in script\n", line);
   resetStack();
@@ -115,7 +134,7 @@ static Value inputNative(int argc, Value *args) {
     return NIL_VAL;
   }
   if (argc == 1) {
-    if (args[0].type == VAL_OBJ && IS_STRING(args[0])) {
+    if (IS_STRING(args[0])) {
       ObjString *str = AS_STRING(args[0]);
       printf("%s", str->chars);
       fflush(stdout);
@@ -202,7 +221,7 @@ static Value rangeNative(int argc, Value *args) {
     return NIL_VAL;
   }
 
-  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  ObjList *list = newList();
   push(OBJ_VAL(list));
   long size = (stop - start) / step;
   list->items = reallocate(list->items, sizeof(Value) * list->capcity,
@@ -222,7 +241,7 @@ static Value allocNative(int argc, Value *args) {
     return NIL_VAL;
   }
   long size = AS_INTEGER(args[0]);
-  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  ObjList *list = newList();
   push(OBJ_VAL(list));
   list->items = reallocate(list->items, sizeof(Value) * list->capcity,
                            sizeof(Value) * size);
@@ -237,7 +256,7 @@ static Value allocNative(int argc, Value *args) {
 static Value typeNative(int argc, Value *args) {
   char *type_str;
   int type_len;
-  switch (args[0].type) {
+  switch (VALUE_TYPE(args[0])) {
   case VAL_BOOL:
     type_str = "bool";
     type_len = 4;
@@ -307,8 +326,13 @@ static Value intNative(int argc, Value *args) {
     runtimeError("Function 'int' requires 1 argument.");
     return NIL_VAL;
   }
-  switch (args[0].type) {
+  switch (VALUE_TYPE(args[0])) {
   case VAL_FLOAT:
+    if (!(AS_FLOATING(args[0]) >= (double)INTEGER_MIN &&
+          AS_FLOATING(args[0]) < -(double)INTEGER_MIN)) {
+      runtimeError("Integer result out of range.");
+      return NIL_VAL;
+    }
     return INTEGER_VAL((long)AS_FLOATING(args[0]));
   case VAL_CHARACTER:
     return INTEGER_VAL((long)AS_CHARACTER(args[0]));
@@ -328,21 +352,21 @@ static Value joinNative(int argc, Value *args) {
   if (!IS_LIST(args[0])) {
     runtimeError("Function 'join' requires a list.");
   }
-  push(args[0]);
   ObjList *list = AS_LIST(args[0]);
-  char *str = (char *)malloc(sizeof(char) * list->count);
   for (int i = 0; i < list->count; i++) {
     if (!IS_CHARACTER(list->items[i])) {
-      free(str);
       runtimeError(
           "Function 'join' requires all list elements to be characters.");
       return NIL_VAL;
     }
-    str[i] = list->items[i].as.character;
   }
+  push(args[0]);
+  ObjString *str_obj = allocateString(list->count);
+  for (int i = 0; i < list->count; i++) {
+    str_obj->chars[i] = AS_CHARACTER(list->items[i]);
+  }
+  str_obj = internString(str_obj);
   pop();
-  ObjString *str_obj = copyString(str, list->count);
-  free(str);
   return OBJ_VAL(str_obj);
 }
 
@@ -355,15 +379,14 @@ static Value splitNative(int argc, Value *args) {
   }
   ObjString *str = AS_STRING(args[0]);
   push(args[0]);
-  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  ObjList *list = newList();
   push(OBJ_VAL(list));
   list->items = reallocate(list->items, sizeof(Value) * list->capcity,
                            sizeof(Value) * str->length);
   list->capcity = str->length;
   list->count = str->length;
   for (int i = 0; i < str->length; i++) {
-    list->items[i].type = VAL_CHARACTER;
-    list->items[i].as.character = str->chars[i];
+    list->items[i] = CHAR_VAL(str->chars[i]);
   }
   Value rv = pop();
   pop();
@@ -373,12 +396,34 @@ static Value splitNative(int argc, Value *args) {
 static void defineNative(const char *name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_INTEGER(slot);
+  }
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  tableSet(&vm.globalSlots, name, INTEGER_VAL(index));
+  pop();
+  return index;
+}
+
 void initVM() {
+  vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
+  if (!vm.frames || !vm.stack) {
+    exit(1);
+  }
   resetStack();
   vm.objects = NULL;
   vm.bytesAllocated = 0;
@@ -386,8 +431,23 @@ void initVM() {
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
+#ifdef GC_INCREMENTAL
+  vm.gcPhase = GC_IDLE;
+  vm.sweepLink = NULL;
+  vm.sweptObjects = NULL;
+  vm.sweptTail = NULL;
+#endif
+#ifdef GC_GENERATIONAL
+  vm.youngObjects = NULL;
+  vm.nextYoungGC = GC_NURSERY_SIZE;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+#endif
   initTable(&vm.strings);
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
   defineNative("clock", clockNative);
@@ -405,450 +465,1157 @@ void initVM() {
   defineNative("alloc", allocNative);
 }
 
+#ifdef DEBUG_OPCODE_STATS
+// Counts of every opcode and of every run of two and three consecutive
+// opcodes, used to pick superinstructions. Runs are counted in execution
+// order, so they can span calls and returns.
+static const char *opcodeNames[] = {
+#define OPCODE_NAME(name) #name,
+    OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+#define OPCODE_COUNT (sizeof(opcodeNames) / sizeof(opcodeNames[0]))
+#define STATS_TOP 20
+
+static uint64_t opcodeCounts[OPCODE_COUNT];
+static uint64_t pairCounts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t tripleCounts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static int previousOps[2] = {-1, -1};
+
+static void countOpcode(uint8_t op) {
+  opcodeCounts[op]++;
+  if (previousOps[1] != -1) {
+    pairCounts[previousOps[1]][op]++;
+    if (previousOps[0] != -1) {
+      tripleCounts[previousOps[0]][previousOps[1]][op]++;
+    }
+  }
+  previousOps[0] = previousOps[1];
+  previousOps[1] = op;
+}
+
+// Prints the STATS_TOP largest entries of counts, a flattened array of
+// runs of length opcodes
+static void printTopRuns(const char *title, uint64_t *counts, int length) {
+  size_t total = 1;
+  for (int i = 0; i < length; i++) {
+    total *= OPCODE_COUNT;
+  }
+  fprintf(stderr, "-- %s --\n", title);
+  for (int rank = 0; rank < STATS_TOP; rank++) {
+    size_t best = 0;
+    for (size_t i = 1; i < total; i++) {
+      if (counts[i] > counts[best]) {
+        best = i;
+      }
+    }
+    if (counts[best] == 0) {
+      break;
+    }
+    fprintf(stderr, "%12llu ", (unsigned long long)counts[best]);
+    size_t run = best;
+    size_t place = total / OPCODE_COUNT;
+    for (int i = 0; i < length; i++) {
+      fprintf(stderr, " %s", opcodeNames[run / place]);
+      run %= place;
+      place /= OPCODE_COUNT;
+    }
+    fprintf(stderr, "\n");
+    counts[best] = 0;
+  }
+}
+
+static void printOpcodeStats() {
+  printTopRuns("opcodes", opcodeCounts, 1);
+  printTopRuns("pairs", &pairCounts[0][0], 2);
+  printTopRuns("triples", &tripleCounts[0][0][0], 3);
+}
+#define COUNT_OPCODE() countOpcode(*ip)
+#else
+#define COUNT_OPCODE() ((void)0)
+#endif
+
 void freeVM() {
+#ifdef DEBUG_OPCODE_STATS
+  printOpcodeStats();
+#endif
   freeTable(&vm.strings);
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
   vm.initString = NULL;
   freeObjects();
+  free(vm.frames);
+  free(vm.stack);
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(Chunk *chunk, uint8_t *ip, Value *stackTop) {
+  printf("          ");
+  for (Value *slot = vm.stack; slot < stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(chunk, (int)(ip - chunk->code));
+}
+#define TRACE_EXECUTION()                                                      \
+  traceExecution(&frame->closure->function->chunk, ip, stackTop)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
 InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  // The hot interpreter state lives in locals so the compiler can keep it in
+  // registers. It is written back to the frame and vm.stackTop with
+  // STORE_FRAME() before anything that can call back into the VM, allocate
+  // (and so collect garbage) or report an error.
+  CallFrame *frame;
+  register uint8_t *ip;
+  register Value *slots;
+  register Value *constants;
+  register Value *stackTop;
+  InlineCache *caches;
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;             \
+    caches = frame->closure->function->caches;                                 \
+  } while (false)
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = stackTop)
+#define LOAD_STACK() (stackTop = vm.stackTop)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BOOLEAN_OP(op)                                                         \
+#define READ_CONSTANT_LONG() (constants[READ_SHORT()])
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define RUNTIME_ERROR(...)                                                     \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+// compare is an expression over the operands a and b
+#define COMPARE(compare, result)                                               \
+  do {                                                                         \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
-    if (IS_INTEGER(peek(0)) && IS_INTEGER(peek(1))) {                          \
-      long b = AS_INTEGER(pop());                                              \
-      long a = AS_INTEGER(pop());                                              \
-      push(BOOL_VAL(a op b));                                                  \
-    } else if (IS_INTEGER(peek(0))) {                                          \
-      double b = (double)AS_INTEGER(pop());                                    \
-      double a = AS_FLOATING(pop());                                           \
-      push(BOOL_VAL(a op b));                                                  \
-    } else if (IS_INTEGER(peek(1))) {                                          \
-      double b = AS_FLOATING(pop());                                           \
-      double a = (double)AS_INTEGER(pop());                                    \
-      push(BOOL_VAL(a op b));                                                  \
+    if (IS_INTEGER(PEEK(0)) && IS_INTEGER(PEEK(1))) {                          \
+      long b = AS_INTEGER(POP());                                              \
+      long a = AS_INTEGER(POP());                                              \
+      result = (compare);                                                      \
+    } else if (IS_INTEGER(PEEK(0))) {                                          \
+      double b = (double)AS_INTEGER(POP());                                    \
+      double a = AS_FLOATING(POP());                                           \
+      result = (compare);                                                      \
+    } else if (IS_INTEGER(PEEK(1))) {                                          \
+      double b = AS_FLOATING(POP());                                           \
+      double a = (double)AS_INTEGER(POP());                                    \
+      result = (compare);                                                      \
     } else {                                                                   \
-      double b = AS_FLOATING(pop());                                           \
-      double a = AS_FLOATING(pop());                                           \
-      push(BOOL_VAL(a op b));                                                  \
+      double b = AS_FLOATING(POP());                                           \
+      double a = AS_FLOATING(POP());                                           \
+      result = (compare);                                                      \
+    }                                                                          \
+  } while (false)
+
+#define BOOLEAN_OP(compare)                                                    \
+  do {                                                                         \
+    bool result;                                                               \
+    COMPARE(compare, result);                                                  \
+    PUSH(BOOL_VAL(result));                                                    \
+  } while (false)
+
+// Pops the operands and jumps if the comparison is false
+#define COMPARE_JUMP(compare)                                                  \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    bool result;                                                               \
+    COMPARE(compare, result);                                                  \
+    ip += offset * (uint16_t)!result;                                          \
+  } while (false)
+
+// Pushes a op b for two integers, which a NaN-boxed build can find is out
+// of range
+#define PUSH_INTEGER(op, a, b)                                                 \
+  do {                                                                         \
+    long result;                                                               \
+    if (!integerArithmetic(#op[0], (a), (b), &result)) {                       \
+      RUNTIME_ERROR("Integer result out of range.");                           \
     }                                                                          \
+    PUSH(INTEGER_VAL(result));                                                 \
   } while (false)
 
 #define BITWISE_OP(op)                                                         \
   do {                                                                         \
-    if (!IS_INTEGER(peek(0)) || !IS_INTEGER(peek(1))) {                        \
-      runtimeError("Operands must be integers.");                              \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_INTEGER(PEEK(0)) || !IS_INTEGER(PEEK(1))) {                        \
+      RUNTIME_ERROR("Operands must be integers.");                             \
     }                                                                          \
-    long b = AS_INTEGER(pop());                                                \
-    long a = AS_INTEGER(pop());                                                \
-    push(INTEGER_VAL(a op b));                                                 \
+    long b = AS_INTEGER(POP());                                                \
+    long a = AS_INTEGER(POP());                                                \
+    PUSH_INTEGER(op, a, b);                                                    \
   } while (false)
 
 #define BINARY_OP(op)                                                          \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
-    if (IS_INTEGER(peek(0)) && IS_INTEGER(peek(1))) {                          \
-      long b = AS_INTEGER(pop());                                              \
-      long a = AS_INTEGER(pop());                                              \
-      push(INTEGER_VAL(a op b));                                               \
-    } else if (IS_INTEGER(peek(0))) {                                          \
-      double b = (double)AS_INTEGER(pop());                                    \
-      double a = AS_FLOATING(pop());                                           \
-      push(FLOAT_VAL(a op b));                                                 \
-    } else if (IS_INTEGER(peek(1))) {                                          \
-      double b = AS_FLOATING(pop());                                           \
-      double a = (double)AS_INTEGER(pop());                                    \
-      push(FLOAT_VAL(a op b));                                                 \
+    if (IS_INTEGER(PEEK(0)) && IS_INTEGER(PEEK(1))) {                          \
+      long b = AS_INTEGER(POP());                                              \
+      long a = AS_INTEGER(POP());                                              \
+      PUSH_INTEGER(op, a, b);                                                  \
+    } else if (IS_INTEGER(PEEK(0))) {                                          \
+      double b = (double)AS_INTEGER(POP());                                    \
+      double a = AS_FLOATING(POP());                                           \
+      PUSH(FLOAT_VAL(a op b));                                                 \
+    } else if (IS_INTEGER(PEEK(1))) {                                          \
+      double b = AS_FLOATING(POP());                                           \
+      double a = (double)AS_INTEGER(POP());                                    \
+      PUSH(FLOAT_VAL(a op b));                                                 \
     } else {                                                                   \
-      double b = AS_FLOATING(pop());                                           \
-      double a = AS_FLOATING(pop());                                           \
-      push(FLOAT_VAL(a op b));                                                 \
+      double b = AS_FLOATING(POP());                                           \
+      double a = AS_FLOATING(POP());                                           \
+      PUSH(FLOAT_VAL(a op b));                                                 \
     }                                                                          \
   } while (false)
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+
+#define ADD_TOP()                                                              \
+  do {                                                                         \
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {                            \
+      BINARY_OP(+);                                                            \
+    } else {                                                                   \
+      STORE_FRAME();                                                           \
+      if (!addObjects()) {                                                     \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+  } while (false)
+
+// Register forms take their operands straight from frame slots (L) or the
+// constant table (K) instead of the stack. Two integers take a fast path;
+// anything else is pushed and handled like the plain opcode would.
+#define READ_LOCAL() (slots[READ_BYTE()])
+#define REGISTER_ARITH(op, left, right, slowPath)                              \
+  do {                                                                         \
+    Value a = (left);                                                          \
+    Value b = (right);                                                         \
+    if (IS_INTEGER(a) && IS_INTEGER(b)) {                                      \
+      PUSH_INTEGER(op, AS_INTEGER(a), AS_INTEGER(b));                          \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      PUSH(b);                                                                 \
+      slowPath;                                                                \
+    }                                                                          \
+  } while (false)
+
+#define REGISTER_JUMP(op, left, right)                                         \
+  do {                                                                         \
+    Value a = (left);                                                          \
+    Value b = (right);                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    bool result;                                                               \
+    if (IS_INTEGER(a) && IS_INTEGER(b)) {                                      \
+      result = AS_INTEGER(a) op AS_INTEGER(b);                                 \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      PUSH(b);                                                                 \
+      COMPARE(a op b, result);                                                 \
+    }                                                                          \
+    ip += offset * (uint16_t)!result;                                          \
+  } while (false)
+
+// The _LONG forms share these with the byte forms, passing in how to read
+// the name operand
+#define GET_PROPERTY(readName)                                                 \
+  do {                                                                         \
+    if (!IS_INSTANCE(PEEK(0))) {                                               \
+      RUNTIME_ERROR("Only instances have properties.");                        \
+    }                                                                          \
+    ObjInstance *inst = AS_INSTANCE(PEEK(0));                                  \
+    ObjString *name = (readName);                                              \
+    InlineCache *cache = READ_CACHE();                                         \
+    if (cache->shape == inst->shape && cache->slot >= 0) {                     \
+      PEEK(0) = inst->fields[cache->slot];                                     \
+    } else {                                                                   \
+      STORE_FRAME();                                                           \
+      if (!getProperty(inst, name, cache)) {                                   \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+      }                                                                        \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+  } while (false)
+
+#define SET_PROPERTY(readName)                                                 \
+  do {                                                                         \
+    if (!IS_INSTANCE(PEEK(1))) {                                               \
+      RUNTIME_ERROR("Only instances have fields.");                            \
+    }                                                                          \
+    ObjInstance *inst = AS_INSTANCE(PEEK(1));                                  \
+    ObjString *name = (readName);                                              \
+    InlineCache *cache = READ_CACHE();                                         \
+    if (cache->shape == inst->shape && cache->slot < inst->capacity) {         \
+      inst->fields[cache->slot] = PEEK(0);                                     \
+      WRITE_BARRIER(inst, PEEK(0));                                            \
+      if (cache->transition) {                                                 \
+        inst->shape = cache->transition;                                       \
+        WRITE_BARRIER(inst, OBJ_VAL(inst->shape));                             \
+      }                                                                        \
+    } else {                                                                   \
+      STORE_FRAME();                                                           \
+      setProperty(inst, name, PEEK(0), cache);                                 \
+    }                                                                          \
+    Value value = POP();                                                       \
+    PEEK(0) = value;                                                           \
+  } while (false)
+
+// readOperand reads the function's constant and each upvalue index
+#define MAKE_CLOSURE(readOperand)                                              \
+  do {                                                                         \
+    ObjFunction *function = AS_FUNCTION(constants[readOperand]);               \
+    STORE_FRAME();                                                             \
+    if (function->record >= 0 && !loadFunction(function)) {                    \
+      RUNTIME_ERROR("Invalid function in program.");                           \
+    }                                                                          \
+    ObjClosure *closure = newClosure(function);                                \
+    PUSH(OBJ_VAL(closure));                                                    \
+    STORE_FRAME();                                                             \
+    for (int i = 0; i < closure->upvalueCount; i++) {                          \
+      uint8_t isLocal = READ_BYTE();                                           \
+      uint16_t index = (readOperand);                                          \
+      if (isLocal) {                                                           \
+        closure->upvalues[i] = captureUpvalue(slots + index);                  \
+      } else {                                                                 \
+        closure->upvalues[i] = frame->closure->upvalues[index];                \
+      }                                                                        \
+      WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));                   \
+    }                                                                          \
+  } while (false)
+
+#ifdef JIT
+// Hands the frame to its native code, if it has any. That runs until it
+// reaches an instruction it does not handle and returns its offset, where the
+// interpreter picks up again.
+#define ENTER_NATIVE()                                                         \
+  do {                                                                         \
+    ObjFunction *function = frame->closure->function;                          \
+    int offset = (int)(ip - function->chunk.code);                             \
+    if (function->native != NULL && function->native->entries[offset] >= 0) { \
+      Value *top = stackTop;                                                   \
+      ip = function->chunk.code +                                              \
+           runNative(function->native, slots, &top, offset);                   \
+      stackTop = top;                                                          \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_NATIVE() ((void)0)
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
+
+// Quickening: a generic arithmetic or comparison opcode that sees two
+// integers or two floats patches itself into a specialised form, which only
+// has to check its guard. When the guard fails the site is patched to a
+// _GENERIC form that never quickens again, so a site that sees both types
+// settles after one change instead of being rewritten on every one.
+#define QUICKEN(intOp, floatOp)                                                \
+  do {                                                                         \
+    if (IS_INTEGER(PEEK(0)) && IS_INTEGER(PEEK(1))) {                          \
+      ip[-1] = intOp;                                                          \
+    } else if (IS_FLOATING(PEEK(0)) && IS_FLOATING(PEEK(1))) {                 \
+      ip[-1] = floatOp;                                                        \
+    }                                                                          \
+  } while (false)
+
+#define DEQUICKEN(generic)                                                     \
+  {                                                                            \
+    ip[-1] = generic;                                                          \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  }
+
+#define INT_OP(valueType, op, generic)                                         \
+  if (!IS_INTEGER(PEEK(0)) || !IS_INTEGER(PEEK(1)))                            \
+    DEQUICKEN(generic)                                                         \
+  {                                                                            \
+    long b = AS_INTEGER(POP());                                                \
+    PEEK(0) = valueType(AS_INTEGER(PEEK(0)) op b);                             \
+  }
+
+#define INT_ARITH(op, generic)                                                 \
+  if (!IS_INTEGER(PEEK(0)) || !IS_INTEGER(PEEK(1)))                            \
+    DEQUICKEN(generic)                                                         \
+  {                                                                            \
+    long b = AS_INTEGER(POP());                                                \
+    long a = AS_INTEGER(POP());                                                \
+    PUSH_INTEGER(op, a, b);                                                    \
+  }
+
+#define FLOAT_OP(valueType, op, generic)                                       \
+  if (!IS_FLOATING(PEEK(0)) || !IS_FLOATING(PEEK(1)))                          \
+    DEQUICKEN(generic)                                                         \
+  {                                                                            \
+    double b = AS_FLOATING(POP());                                             \
+    PEEK(0) = valueType(AS_FLOATING(PEEK(0)) op b);                            \
+  }
+
+#define INT_JUMP(op, generic)                                                  \
+  if (!IS_INTEGER(PEEK(0)) || !IS_INTEGER(PEEK(1)))                            \
+    DEQUICKEN(generic)                                                         \
+  {                                                                            \
+    uint16_t offset = READ_SHORT();                                            \
+    long b = AS_INTEGER(POP());                                                \
+    long a = AS_INTEGER(POP());                                                \
+    ip += offset * (uint16_t)!(a op b);                                        \
+  }
+
+#define FLOAT_JUMP(op, generic)                                                \
+  if (!IS_FLOATING(PEEK(0)) || !IS_FLOATING(PEEK(1)))                          \
+    DEQUICKEN(generic)                                                         \
+  {                                                                            \
+    uint16_t offset = READ_SHORT();                                            \
+    double b = AS_FLOATING(POP());                                             \
+    double a = AS_FLOATING(POP());                                             \
+    ip += offset * (uint16_t)!(a op b);                                        \
+  }
+
+// Calls closure in place of the current frame. The callee and its arguments
+// take over the frame's slots, and the frame is popped before the call
+// pushes its own. The arity must already be known to match, so the call
+// can't fail once the frame is gone.
+#define TAIL_CALL(closure, count)                                              \
+  do {                                                                         \
+    ObjClosure *target = (closure);                                            \
+    closeUpvalues(slots);                                                      \
+    memmove(slots, stackTop - (count) - 1, sizeof(Value) * ((count) + 1));     \
+    stackTop = slots + (count) + 1;                                            \
+    vm.frameCount--;                                                           \
+    STORE_FRAME();                                                             \
+    if (!callClosure(target, (count))) {                                       \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    }                                                                          \
+    LOAD_FRAME();                                                              \
+    LOAD_STACK();                                                              \
+    ENTER_NATIVE();                                                            \
+  } while (false)
+
+#ifdef COMPUTED_GOTO
+  static void *dispatchTable[] = {
+#define OPCODE_LABEL(name) &&do_##name,
+      OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+  };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) do_##name
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    COUNT_OPCODE();                                                            \
+    goto *dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+#else
+#define INTERPRET_LOOP                                                         \
+  for (;;)                                                                     \
+    switch (TRACE_EXECUTION(), COUNT_OPCODE(), instruction = READ_BYTE())
+#define CASE(name) case name
+#define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
+  LOAD_STACK();
+  uint8_t instruction;
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT): {
       Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+    CASE(OP_CONSTANT_LONG): {
+      Value constant = READ_CONSTANT_LONG();
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_NIL):
+      PUSH(NIL_VAL);
+      DISPATCH();
+    CASE(OP_TRUE):
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE):
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_POP):
+      stackTop--;
+      DISPATCH();
+    CASE(OP_GET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    CASE(OP_GET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
+    CASE(OP_SET_LOCAL_LONG): {
+      uint16_t slot = READ_SHORT();
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_SET_LOCAL_POP): {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      slots[slot] = POP();
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
+    CASE(OP_INCREMENT_LOCAL): {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
-    }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtimeError("Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
+      Value amount = READ_CONSTANT();
+      long sum;
+      if (IS_INTEGER(slots[slot]) && IS_INTEGER(amount) &&
+          integerArithmetic('+', AS_INTEGER(slots[slot]), AS_INTEGER(amount),
+                            &sum)) {
+        slots[slot] = INTEGER_VAL(sum);
+        DISPATCH();
       }
-      ObjInstance *inst = AS_INSTANCE(peek(0));
-      ObjString *name = READ_STRING();
-      Value val;
-      if (tableGet(&inst->fields, name, &val)) {
-        pop(); // clear the instance
-        push(val);
-        break;
+      if (!IS_NUMBER(slots[slot])) {
+        RUNTIME_ERROR(
+            "Operands must be two numbers, two lists, or two strings.");
       }
-      if (!bindMethod(inst->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      PUSH(slots[slot]);
+      PUSH(amount);
+      BINARY_OP(+);
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtimeError("Only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_DEFINE_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      vm.globalValues.values[slot] = PEEK(0);
+      stackTop--;
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
-      ObjInstance *inst = AS_INSTANCE(peek(1));
-      tableSet(&inst->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop();
-      push(value);
-      break;
+      vm.globalValues.values[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = PEEK(0);
+      WRITE_BARRIER(upvalue, PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE_LONG): {
+      uint16_t slot = READ_SHORT();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_GET_SUPER: {
+    CASE(OP_SET_UPVALUE_LONG): {
+      ObjUpvalue *upvalue = frame->closure->upvalues[READ_SHORT()];
+      *upvalue->location = PEEK(0);
+      WRITE_BARRIER(upvalue, PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_PROPERTY):
+      PUSH(slots[READ_BYTE()]);
+      // Falls through to OP_GET_PROPERTY
+    CASE(OP_GET_PROPERTY):
+      GET_PROPERTY(READ_STRING());
+      DISPATCH();
+    CASE(OP_GET_PROPERTY_LONG):
+      GET_PROPERTY(READ_STRING_LONG());
+      DISPATCH();
+    CASE(OP_SET_PROPERTY):
+      SET_PROPERTY(READ_STRING());
+      DISPATCH();
+    CASE(OP_SET_PROPERTY_LONG):
+      SET_PROPERTY(READ_STRING_LONG());
+      DISPATCH();
+    CASE(OP_GET_SUPER): {
       ObjString *name = READ_STRING();
-      ObjClass *superclass = AS_CLASS(pop());
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!bindMethod(superclass, name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      LOAD_STACK();
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
-    }
-    case OP_GREATER:
-      BOOLEAN_OP(>);
-      break;
-    case OP_LESS:
-      BOOLEAN_OP(<);
-      break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenateStrings();
-      } else if (IS_LIST(peek(0)) && IS_LIST(peek(1))) {
-        concatenateLists();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        BINARY_OP(+);
-      } else {
-        runtimeError(
-            "Operands must be two numbers, two lists, or two strings.");
+    CASE(OP_GET_SUPER_LONG): {
+      ObjString *name = READ_STRING_LONG();
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!bindMethod(superclass, name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
     }
-    case OP_SUBTRACT:
+    CASE(OP_NOT_EQUAL): {
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(!valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):
+      QUICKEN(OP_GREATER_INT, OP_GREATER_FLOAT);
+      BOOLEAN_OP(a > b);
+      DISPATCH();
+    CASE(OP_GREATER_GENERIC):
+      BOOLEAN_OP(a > b);
+      DISPATCH();
+    CASE(OP_LESS):
+      QUICKEN(OP_LESS_INT, OP_LESS_FLOAT);
+      BOOLEAN_OP(a < b);
+      DISPATCH();
+    CASE(OP_LESS_GENERIC):
+      BOOLEAN_OP(a < b);
+      DISPATCH();
+    CASE(OP_GREATER_INT):
+      INT_OP(BOOL_VAL, >, OP_GREATER_GENERIC);
+      DISPATCH();
+    CASE(OP_GREATER_FLOAT):
+      FLOAT_OP(BOOL_VAL, >, OP_GREATER_GENERIC);
+      DISPATCH();
+    CASE(OP_LESS_INT):
+      INT_OP(BOOL_VAL, <, OP_LESS_GENERIC);
+      DISPATCH();
+    CASE(OP_LESS_FLOAT):
+      FLOAT_OP(BOOL_VAL, <, OP_LESS_GENERIC);
+      DISPATCH();
+    CASE(OP_GREATER_EQUAL):
+      BOOLEAN_OP(!(a < b));
+      DISPATCH();
+    CASE(OP_LESS_EQUAL):
+      BOOLEAN_OP(!(a > b));
+      DISPATCH();
+    CASE(OP_ADD):
+      QUICKEN(OP_ADD_INT, OP_ADD_FLOAT);
+      ADD_TOP();
+      DISPATCH();
+    CASE(OP_ADD_GENERIC):
+      ADD_TOP();
+      DISPATCH();
+    CASE(OP_SUBTRACT):
+      QUICKEN(OP_SUBTRACT_INT, OP_SUBTRACT_FLOAT);
       BINARY_OP(-);
-      break;
-    case OP_MULTIPLY:
+      DISPATCH();
+    CASE(OP_SUBTRACT_GENERIC):
+      BINARY_OP(-);
+      DISPATCH();
+    CASE(OP_MULTIPLY):
+      QUICKEN(OP_MULTIPLY_INT, OP_MULTIPLY_FLOAT);
       BINARY_OP(*);
-      break;
-    case OP_DIVIDE:
+      DISPATCH();
+    CASE(OP_MULTIPLY_GENERIC):
+      BINARY_OP(*);
+      DISPATCH();
+    CASE(OP_ADD_INT):
+      INT_ARITH(+, OP_ADD_GENERIC);
+      DISPATCH();
+    CASE(OP_ADD_FLOAT):
+      FLOAT_OP(FLOAT_VAL, +, OP_ADD_GENERIC);
+      DISPATCH();
+    CASE(OP_SUBTRACT_INT):
+      INT_ARITH(-, OP_SUBTRACT_GENERIC);
+      DISPATCH();
+    CASE(OP_SUBTRACT_FLOAT):
+      FLOAT_OP(FLOAT_VAL, -, OP_SUBTRACT_GENERIC);
+      DISPATCH();
+    CASE(OP_MULTIPLY_INT):
+      INT_ARITH(*, OP_MULTIPLY_GENERIC);
+      DISPATCH();
+    CASE(OP_MULTIPLY_FLOAT):
+      FLOAT_OP(FLOAT_VAL, *, OP_MULTIPLY_GENERIC);
+      DISPATCH();
+    CASE(OP_DIVIDE):
       BINARY_OP(/);
-      break;
-    case OP_BIT_AND:
+      DISPATCH();
+    CASE(OP_BIT_AND):
       BITWISE_OP(&);
-      break;
-    case OP_BIT_OR:
+      DISPATCH();
+    CASE(OP_BIT_OR):
       BITWISE_OP(|);
-      break;
-    case OP_BIT_XOR:
+      DISPATCH();
+    CASE(OP_BIT_XOR):
       BITWISE_OP(^);
-      break;
-    case OP_LSL:
+      DISPATCH();
+    CASE(OP_LSL):
       BITWISE_OP(<<);
-      break;
-    case OP_LSR:
+      DISPATCH();
+    CASE(OP_LSR):
       BITWISE_OP(>>);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE: {
-      Value v = peek(0);
+      DISPATCH();
+    CASE(OP_NOT):
+      PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    CASE(OP_NEGATE): {
+      Value v = PEEK(0);
       if (!IS_NUMBER(v)) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      pop();
       if (IS_INTEGER(v)) {
-        push(INTEGER_VAL(-AS_INTEGER(v)));
+        long result;
+        if (!integerArithmetic('-', 0, AS_INTEGER(v), &result)) {
+          RUNTIME_ERROR("Integer result out of range.");
+        }
+        PEEK(0) = INTEGER_VAL(result);
       } else {
-        push(FLOAT_VAL(-AS_FLOATING(v)));
+        PEEK(0) = FLOAT_VAL(-AS_FLOATING(v));
       }
-      break;
+      DISPATCH();
     }
-    case OP_PRINT:
-      printValue(pop());
+    CASE(OP_PRINT):
+      printValue(POP());
       printf("\n");
-      break;
-    case OP_JUMP_IF_FALSE: {
+      DISPATCH();
+    CASE(OP_JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset * (uint16_t)isFalsey(peek(0));
-      break;
+      ip += offset * (uint16_t)isFalsey(PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_ADD_LL):
+      REGISTER_ARITH(+, READ_LOCAL(), READ_LOCAL(), ADD_TOP());
+      DISPATCH();
+    CASE(OP_ADD_LK):
+      REGISTER_ARITH(+, READ_LOCAL(), READ_CONSTANT(), ADD_TOP());
+      DISPATCH();
+    CASE(OP_ADD_LLL): {
+      uint8_t dst = READ_BYTE();
+      REGISTER_ARITH(+, READ_LOCAL(), READ_LOCAL(), ADD_TOP());
+      slots[dst] = POP();
+      DISPATCH();
+    }
+    CASE(OP_ADD_LLK): {
+      uint8_t dst = READ_BYTE();
+      REGISTER_ARITH(+, READ_LOCAL(), READ_CONSTANT(), ADD_TOP());
+      slots[dst] = POP();
+      DISPATCH();
     }
-    case OP_JUMP: {
+    CASE(OP_SUBTRACT_LL):
+      REGISTER_ARITH(-, READ_LOCAL(), READ_LOCAL(), BINARY_OP(-));
+      DISPATCH();
+    CASE(OP_SUBTRACT_LK):
+      REGISTER_ARITH(-, READ_LOCAL(), READ_CONSTANT(), BINARY_OP(-));
+      DISPATCH();
+    CASE(OP_SUBTRACT_LLL): {
+      uint8_t dst = READ_BYTE();
+      REGISTER_ARITH(-, READ_LOCAL(), READ_LOCAL(), BINARY_OP(-));
+      slots[dst] = POP();
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_LLK): {
+      uint8_t dst = READ_BYTE();
+      REGISTER_ARITH(-, READ_LOCAL(), READ_CONSTANT(), BINARY_OP(-));
+      slots[dst] = POP();
+      DISPATCH();
+    }
+    CASE(OP_LESS_JUMP_LL):
+      REGISTER_JUMP(<, READ_LOCAL(), READ_LOCAL());
+      DISPATCH();
+    CASE(OP_LESS_JUMP_LK):
+      REGISTER_JUMP(<, READ_LOCAL(), READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_GREATER_JUMP_LL):
+      REGISTER_JUMP(>, READ_LOCAL(), READ_LOCAL());
+      DISPATCH();
+    CASE(OP_GREATER_JUMP_LK):
+      REGISTER_JUMP(>, READ_LOCAL(), READ_CONSTANT());
+      DISPATCH();
+    CASE(OP_MOVE): {
+      uint8_t dst = READ_BYTE();
+      slots[dst] = READ_LOCAL();
+      DISPATCH();
+    }
+    CASE(OP_EQUAL_JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      Value b = POP();
+      Value a = POP();
+      ip += offset * (uint16_t)!valuesEqual(a, b);
+      DISPATCH();
     }
-    case OP_LOOP: {
+    CASE(OP_NOT_EQUAL_JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      Value b = POP();
+      Value a = POP();
+      ip += offset * (uint16_t)valuesEqual(a, b);
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(OP_GREATER_JUMP):
+      QUICKEN(OP_GREATER_JUMP_INT, OP_GREATER_JUMP_FLOAT);
+      COMPARE_JUMP(a > b);
+      DISPATCH();
+    CASE(OP_GREATER_JUMP_GENERIC):
+      COMPARE_JUMP(a > b);
+      DISPATCH();
+    CASE(OP_GREATER_JUMP_INT):
+      INT_JUMP(>, OP_GREATER_JUMP_GENERIC);
+      DISPATCH();
+    CASE(OP_GREATER_JUMP_FLOAT):
+      FLOAT_JUMP(>, OP_GREATER_JUMP_GENERIC);
+      DISPATCH();
+    CASE(OP_GREATER_EQUAL_JUMP):
+      COMPARE_JUMP(!(a < b));
+      DISPATCH();
+    CASE(OP_LESS_JUMP):
+      QUICKEN(OP_LESS_JUMP_INT, OP_LESS_JUMP_FLOAT);
+      COMPARE_JUMP(a < b);
+      DISPATCH();
+    CASE(OP_LESS_JUMP_GENERIC):
+      COMPARE_JUMP(a < b);
+      DISPATCH();
+    CASE(OP_LESS_JUMP_INT):
+      INT_JUMP(<, OP_LESS_JUMP_GENERIC);
+      DISPATCH();
+    CASE(OP_LESS_JUMP_FLOAT):
+      FLOAT_JUMP(<, OP_LESS_JUMP_GENERIC);
+      DISPATCH();
+    CASE(OP_LESS_EQUAL_JUMP):
+      COMPARE_JUMP(!(a > b));
+      DISPATCH();
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+#ifdef JIT
+      if (warmUp(frame->closure->function)) {
+        STORE_FRAME();
+        compileNative(frame->closure->function);
+      }
+#endif
+      ENTER_NATIVE();
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
       int count = READ_BYTE();
-      if (!callValue(peek(count), count)) {
+      STORE_FRAME();
+      if (!callValue(PEEK(count), count)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      LOAD_STACK();
+      ENTER_NATIVE();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      int count = READ_BYTE();
+      Value callee = PEEK(count);
+      ObjClosure *closure = NULL;
+      if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+      } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+      }
+      if (closure == NULL || closure->function->arity != count) {
+        // Natives, classes and calls that are going to fail run as ordinary
+        // calls, so errors are reported from this frame
+        STORE_FRAME();
+        if (!callValue(callee, count)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        LOAD_STACK();
+        ENTER_NATIVE();
+        DISPATCH();
+      }
+      if (IS_BOUND_METHOD(callee)) {
+        PEEK(count) = AS_BOUND_METHOD(callee)->receiver;
+      }
+      TAIL_CALL(closure, count);
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE: {
+    CASE(OP_TAIL_INVOKE): {
       ObjString *method = READ_STRING();
-      int argCount = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(pop());
-      if (!invokeFromClass(superclass, method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
+      int argc = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      Value receiver = PEEK(argc);
+      ObjClosure *closure = NULL;
+      if (IS_INSTANCE(receiver)) {
+        closure = lookupMethod(AS_INSTANCE(receiver), method, cache);
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      if (closure == NULL || closure->function->arity != argc) {
+        // Functions stored in fields, and invokes that are going to fail, run
+        // as ordinary invokes
+        STORE_FRAME();
+        if (!invoke(method, argc, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        LOAD_STACK();
+        ENTER_NATIVE();
+        DISPATCH();
+      }
+      TAIL_CALL(closure, argc);
+      DISPATCH();
     }
-    case OP_CLOSURE: {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure *closure = newClosure(function);
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
+    CASE(OP_TAIL_SUPER_INVOKE): {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(POP());
+      Value closure;
+      if (!tableGet(&superclass->methods, method, &closure) ||
+          AS_CLOSURE(closure)->function->arity != argCount) {
+        STORE_FRAME();
+        if (!invokeFromClass(superclass, method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
         }
+        LOAD_FRAME();
+        LOAD_STACK();
+        ENTER_NATIVE();
+        DISPATCH();
       }
-      break;
+      TAIL_CALL(AS_CLOSURE(closure), argCount);
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE): {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      LOAD_STACK();
+      ENTER_NATIVE();
+      DISPATCH();
     }
-    case OP_INVOKE: {
+    CASE(OP_CLOSURE):
+      MAKE_CLOSURE(READ_BYTE());
+      DISPATCH();
+    CASE(OP_CLOSURE_LONG):
+      MAKE_CLOSURE(READ_SHORT());
+      DISPATCH();
+    CASE(OP_INVOKE): {
       ObjString *method = READ_STRING();
       int argc = READ_BYTE();
-      if (!invoke(method, argc)) {
+      InlineCache *cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(method, argc, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      LOAD_STACK();
+      ENTER_NATIVE();
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
-    case OP_RETURN: {
-      Value result = pop();
-      closeUpvalues(frame->slots);
+    CASE(OP_CLOSE_UPVALUE):
+      closeUpvalues(stackTop - 1);
+      stackTop--;
+      DISPATCH();
+    CASE(OP_RETURN): {
+      Value result = POP();
+      closeUpvalues(slots);
       vm.frameCount--;
       if (vm.frameCount == 0) {
-        pop();
+        vm.stackTop = stackTop - 1;
         return INTERPRET_OK;
       }
-      vm.stackTop = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      stackTop = slots;
+      PUSH(result);
+      LOAD_FRAME();
+      ENTER_NATIVE();
+      DISPATCH();
     }
-    case OP_CLASS:
-      push(OBJ_VAL(newClass(READ_STRING())));
-      break;
-    case OP_INHERIT: {
-      Value superclass = peek(1);
+    CASE(OP_CLASS): {
+      ObjString *name = READ_STRING();
+      STORE_FRAME();
+      PUSH(OBJ_VAL(newClass(name)));
+      DISPATCH();
+    }
+    CASE(OP_CLASS_LONG): {
+      ObjString *name = READ_STRING_LONG();
+      STORE_FRAME();
+      PUSH(OBJ_VAL(newClass(name)));
+      DISPATCH();
+    }
+    CASE(OP_INHERIT): {
+      Value superclass = PEEK(1);
       if (!IS_CLASS(superclass)) {
-        runtimeError("Superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      ObjClass *subclass = AS_CLASS(peek(0));
+      ObjClass *subclass = AS_CLASS(PEEK(0));
+      STORE_FRAME();
       tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-      pop();
-      break;
+      rememberObject((Obj *)subclass);
+      subclass->version++;
+      stackTop--;
+      DISPATCH();
     }
-    case OP_METHOD:
-      defineMethod(READ_STRING());
-      break;
-    case OP_BUILD_LIST: {
-      ObjList *list = newList();
+    CASE(OP_METHOD): {
+      ObjString *name = READ_STRING();
+      STORE_FRAME();
+      defineMethod(name);
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_METHOD_LONG): {
+      ObjString *name = READ_STRING_LONG();
+      STORE_FRAME();
+      defineMethod(name);
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(OP_BUILD_LIST): {
       uint8_t itemCount = READ_BYTE();
-      push(OBJ_VAL(list));
+      STORE_FRAME();
+      ObjList *list = newList();
+      PUSH(OBJ_VAL(list));
+      STORE_FRAME();
       for (int i = itemCount; i > 0; i--) {
-        appendToList(list, peek(i));
+        appendToList(list, PEEK(i));
       }
-      pop();
-      while (itemCount-- > 0) {
-        pop();
-      }
-      push(OBJ_VAL(list));
-      break;
+      stackTop -= itemCount + 1;
+      PUSH(OBJ_VAL(list));
+      DISPATCH();
     }
-    case OP_INDEX_SUBSCR: {
+    CASE(OP_GET_LOCAL_INDEX):
+      PUSH(slots[READ_BYTE()]);
+      // Falls through to OP_INDEX_SUBSCR
+    CASE(OP_INDEX_SUBSCR): {
       // Don't need to check b/c we're gonna trust the compiler
-      Value idx_val = pop();
-      Value list_val = pop();
+      Value idx_val = POP();
+      Value list_val = POP();
       if (IS_LIST(list_val)) {
         Value rv;
         ObjList *list = AS_LIST(list_val);
         if (!IS_NUMBER(idx_val)) {
-          runtimeError("List index is not a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index is not a number.");
         }
         int idx;
-        if (idx_val.type == VAL_FLOAT) {
-          idx = (int)idx_val.as.floating;
+        if (IS_FLOATING(idx_val)) {
+          idx = (int)AS_FLOATING(idx_val);
         } else {
-          idx = (int)idx_val.as.integer;
+          idx = (int)AS_INTEGER(idx_val);
         }
 
         if (indexFromList(list, idx, &rv)) {
-          runtimeError("List index out of range");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index out of range");
         }
-        push(rv);
+        PUSH(rv);
       } else if (IS_STRING(list_val)) {
         ObjString *str = AS_STRING(list_val);
         int idx;
-        if (idx_val.type == VAL_FLOAT) {
-          idx = (int)idx_val.as.floating;
+        if (IS_FLOATING(idx_val)) {
+          idx = (int)AS_FLOATING(idx_val);
         } else {
-          idx = (int)idx_val.as.integer;
+          idx = (int)AS_INTEGER(idx_val);
         }
         if (idx < 0) {
           idx = str->length + idx;
         }
         if (str->length <= idx || idx < 0) {
-          runtimeError("List index out of range");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index out of range");
         }
-        push(CHAR_VAL(str->chars[idx]));
+        PUSH(CHAR_VAL(str->chars[idx]));
       } else {
-        runtimeError("Unable to index into value.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Unable to index into value.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_STORE_SUBSCR: {
-      Value item = pop();
-      Value idx_val = pop();
-      Value list_val = pop();
+    CASE(OP_STORE_SUBSCR): {
+      Value item = POP();
+      Value idx_val = POP();
+      Value list_val = POP();
       if (!IS_LIST(list_val)) {
-        runtimeError("Cannot store value in non-list.");
+        RUNTIME_ERROR("Cannot store value in non-list.");
       }
       if (!IS_NUMBER(idx_val)) {
-        runtimeError("List index is not a number.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("List index is not a number.");
       }
       ObjList *list = AS_LIST(list_val);
       int idx;
-      if (idx_val.type == VAL_FLOAT) {
-        idx = (int)idx_val.as.floating;
+      if (IS_FLOATING(idx_val)) {
+        idx = (int)AS_FLOATING(idx_val);
       } else {
-        idx = (int)idx_val.as.integer;
+        idx = (int)AS_INTEGER(idx_val);
       }
       if (storeToList(list, idx, item)) {
-        runtimeError("Invalid list index.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Invalid list index.");
       }
-      push(item);
-      break;
-    }
+      PUSH(item);
+      DISPATCH();
     }
   }
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef LOAD_STACK
+#undef PUSH
+#undef POP
+#undef PEEK
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_SHORT
 #undef BINARY_OP
 #undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef TRACE_EXECUTION
+#undef COUNT_OPCODE
+#undef ADD_TOP
+#undef READ_LOCAL
+#undef REGISTER_ARITH
+#undef REGISTER_JUMP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef INT_OP
+#undef FLOAT_OP
+#undef INT_JUMP
+#undef FLOAT_JUMP
+#undef TAIL_CALL
+#undef ENTER_NATIVE
+#undef GET_PROPERTY
+#undef SET_PROPERTY
+#undef MAKE_CLOSURE
 }
 
 #ifndef VM_ONLY
@@ -887,13 +1654,10 @@ static void concatenateStrings() {
   ObjString *b = AS_STRING(peek(0));
   ObjString *a = AS_STRING(peek(1));
 
-  int len = a->length + b->length;
-  char *chars = ALLOCATE(char, len + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[len] = 0;
-
-  ObjString *result = takeString(chars, len);
+  ObjString *result = allocateString(a->length + b->length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+  result = internString(result);
   pop();
   pop();
   push(OBJ_VAL(result));
@@ -905,8 +1669,8 @@ static void concatenateLists() {
 
   int len = a->count + b->count;
   Value *vals = ALLOCATE(Value, len);
-  memcpy(vals, a->items, a->count);
-  memcpy(vals + a->count, b->items, b->count);
+  memcpy(vals, a->items, sizeof(Value) * a->count);
+  memcpy(vals + a->count, b->items, sizeof(Value) * b->count);
 
   ObjList *result = ALLOCATE_OBJ(ObjList, OBJ_LIST);
   result->items = vals;
@@ -917,13 +1681,81 @@ static void concatenateLists() {
   push(OBJ_VAL(result));
 }
 
+// OP_ADD for anything other than two numbers
+static bool addObjects() {
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    concatenateStrings();
+  } else if (IS_LIST(peek(0)) && IS_LIST(peek(1))) {
+    concatenateLists();
+  } else {
+    runtimeError("Operands must be two numbers, two lists, or two strings.");
+    return false;
+  }
+  return true;
+}
+
+// Moves the value stack to a block with room for at least capacity values,
+// updating everything that points into it. Anything else holding a stack
+// pointer has to reload it after a call.
+static bool growStack(int capacity) {
+  if (capacity > STACK_MAX) {
+    return false;
+  }
+  int newCapacity = vm.stackCapacity;
+  while (newCapacity < capacity) {
+    newCapacity *= 2;
+  }
+  if (newCapacity > STACK_MAX) {
+    newCapacity = STACK_MAX;
+  }
+  Value *stack = (Value *)malloc(sizeof(Value) * newCapacity);
+  if (!stack) {
+    exit(1);
+  }
+  memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+  free(vm.stack);
+  vm.stack = stack;
+  vm.stackCapacity = newCapacity;
+  return true;
+}
+
+static bool growFrames() {
+  if (vm.frameCapacity == FRAMES_MAX) {
+    return false;
+  }
+  int capacity = vm.frameCapacity * 2;
+  if (capacity > FRAMES_MAX) {
+    capacity = FRAMES_MAX;
+  }
+  CallFrame *frames =
+      (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (!frames) {
+    exit(1);
+  }
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+  return true;
+}
+
 bool callClosure(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity,
                  argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
+  int base = (int)(vm.stackTop - vm.stack) - argCount - 1;
+  // PUSH doesn't check for room, so the frame reserves all it can use
+  int size = closure->function->maxStack + STACK_HEADROOM;
+  if ((vm.frameCount == vm.frameCapacity && !growFrames()) ||
+      (base + size > vm.stackCapacity && !growStack(base + size))) {
     runtimeError("Stack overflow.");
     return false;
   }
@@ -931,6 +1763,11 @@ bool callClosure(ObjClosure *closure, int argCount) {
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+#ifdef JIT
+  if (warmUp(closure->function)) {
+    compileNative(closure->function);
+  }
+#endif
   return true;
 }
 
@@ -980,22 +1817,101 @@ static bool invokeFromClass(ObjClass *clazz, ObjString *name, int argCount) {
   return callClosure(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+// Inline caches belong to the function of the frame that is executing
+static void cacheBarrier(InlineCache *cache) {
+  Obj *function = (Obj *)vm.frames[vm.frameCount - 1].closure->function;
+  WRITE_BARRIER(function, OBJ_VAL(cache->shape));
+  WRITE_BARRIER(function, OBJ_VAL(cache->transition));
+  WRITE_BARRIER(function, OBJ_VAL(cache->method));
+}
+
+// Resolves name to a method of inst's class, unless a field shadows it. The
+// shape pins down both the class and the absence of such a field.
+static ObjClosure *lookupMethod(ObjInstance *inst, ObjString *name,
+                                InlineCache *cache) {
+  ObjClass *klass = inst->klass;
+  if (cache->shape == inst->shape && cache->method &&
+      cache->version == klass->version) {
+    return cache->method;
+  }
+  Value method;
+  if (shapeSlot(inst->shape, name) >= 0 ||
+      !tableGet(&klass->methods, name, &method)) {
+    return NULL;
+  }
+  cache->shape = inst->shape;
+  cache->transition = NULL;
+  cache->slot = -1;
+  cache->version = klass->version;
+  cache->method = AS_CLOSURE(method);
+  cacheBarrier(cache);
+  return cache->method;
+}
+
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
   Value receiver = peek(argCount);
   if (!IS_INSTANCE(receiver)) {
     runtimeError("Only instances have methods.");
     return false;
   }
   ObjInstance *inst = AS_INSTANCE(receiver);
-  Value value;
+  ObjClosure *method = lookupMethod(inst, name, cache);
+  if (method) {
+    return callClosure(method, argCount);
+  }
   // Handle the case where this could be a closure
-  if (tableGet(&inst->fields, name, &value)) {
+  int slot = shapeSlot(inst->shape, name);
+  if (slot >= 0) {
+    Value value = inst->fields[slot];
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
   return invokeFromClass(inst->klass, name, argCount);
 }
 
+static bool getProperty(ObjInstance *inst, ObjString *name,
+                        InlineCache *cache) {
+  int slot = shapeSlot(inst->shape, name);
+  if (slot >= 0) {
+    cache->shape = inst->shape;
+    cache->transition = NULL;
+    cache->slot = slot;
+    cache->method = NULL;
+    cacheBarrier(cache);
+    vm.stackTop[-1] = inst->fields[slot];
+    return true;
+  }
+  ObjClosure *method = lookupMethod(inst, name, cache);
+  if (!method) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  ObjBoundMethod *bound = newBoundMethod(peek(0), method);
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+static void setProperty(ObjInstance *inst, ObjString *name, Value value,
+                        InlineCache *cache) {
+  ObjShape *shape = inst->shape;
+  int slot = shapeSlot(shape, name);
+  ObjShape *transition = NULL;
+  if (slot >= 0) {
+    inst->fields[slot] = value;
+    WRITE_BARRIER(inst, value);
+  } else {
+    slot = shape->slotCount;
+    transition = shapeTransition(shape, name);
+    addField(inst, transition, value);
+  }
+  cache->shape = shape;
+  cache->transition = transition;
+  cache->slot = slot;
+  cache->method = NULL;
+  cacheBarrier(cache);
+}
+
 static bool bindMethod(ObjClass *clazz, ObjString *name) {
   Value method;
   if (!tableGet(&clazz->methods, name, &method)) {
@@ -1033,6 +1949,7 @@ static void closeUpvalues(Value *last) {
   while (vm.openUpvalues && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
+    WRITE_BARRIER(upvalue, upvalue->closed);
     upvalue->location = &upvalue->closed;
     vm.openUpvalues = upvalue->next;
   }
@@ -1042,5 +1959,7 @@ static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *clazz = AS_CLASS(peek(1));
   tableSet(&clazz->methods, name, method);
+  WRITE_BARRIER(clazz, method);
+  clazz->version++;
   pop();
 }
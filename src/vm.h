@@ -7,8 +7,27 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The frame and value stacks start with room for FRAMES_INITIAL frames and
+// grow on demand up to FRAMES_MAX
+#ifndef FRAMES_INITIAL
+#define FRAMES_INITIAL 4
+#endif
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 4096
+#endif
+// Stack each frame is budgeted when sizing the value stack. A call reserves
+// its function's maxStack, which can be more or less than this.
+#define FRAME_STACK (2 * UINT8_COUNT)
+// Reserved past maxStack for values the runtime pushes while an instruction
+// runs: natives and the slow path of OP_INCREMENT_LOCAL push up to two
+#define STACK_HEADROOM 2
+#define STACK_INITIAL (FRAMES_INITIAL * FRAME_STACK)
+#define STACK_MAX (FRAMES_MAX * FRAME_STACK)
+
+// Marks a global slot that the compiler has handed out but that has not been
+// defined yet
+#define UNDEFINED_VAL OBJ_VAL(NULL)
+#define IS_UNDEFINED(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
 
 typedef struct {
   ObjClosure *closure;
@@ -16,15 +35,25 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
+#ifdef GC_INCREMENTAL
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP } GCPhase;
+#endif
+
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frameCount;
+  int frameCapacity;
   Chunk *chunk;
   uint8_t *ip;
-  Value stack[STACK_MAX];
+  Value *stack;
+  int stackCapacity;
   Value *stackTop;
   Table strings;
-  Table globals;
+  // Globals live in globalValues, indexed by the slot the compiler resolved
+  // their name to through globalSlots
+  Table globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
   ObjString *initString;
   ObjUpvalue *openUpvalues;
   size_t bytesAllocated;
@@ -33,6 +62,24 @@ typedef struct {
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+#ifdef GC_INCREMENTAL
+  GCPhase gcPhase;
+  // Link to the next object the sweep phase will look at
+  Obj **sweepLink;
+  // Objects allocated while sweeping, kept apart until the sweep is done
+  Obj *sweptObjects;
+  Obj *sweptTail;
+#endif
+#ifdef GC_GENERATIONAL
+  // Objects allocated since the last collection. Everything on vm.objects
+  // has survived one and keeps its mark bit set until the next full cycle.
+  Obj *youngObjects;
+  size_t nextYoungGC;
+  // Old objects that have been given a reference to a young one
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+#endif
 } VM;
 
 typedef enum {
@@ -48,6 +95,7 @@ void freeVM();
 InterpretResult interpret(const char *src);
 InterpretResult run();
 bool callClosure(ObjClosure *closure, int argCount);
+int globalSlot(ObjString *name);
 void push(Value value);
 Value pop();
 #endif